@@ -9,16 +9,79 @@
 // The dot character specifies an "open" cell.
 // The @ character specifies an "obstacle" or "wall" cell
 //
+// With -resume, the rows are written in fixed size chunks and each completed
+// chunk is recorded in a journal file along with its checksum.  The journal
+// also records the seed and parameters, so rerunning with -resume after an
+// interruption verifies the chunks already on disk and only regenerates the
+// missing or corrupt ones.
+//
+// Every run prints a digest of the map text and writes it to a manifest file
+// along with the parameters.  The digest doesn't depend on how the rows were
+// split between threads, so -verify can regenerate the map from the seed with
+// any number of threads, re-hash the existing map file in parallel, and
+// compare both against the manifest.
+//
+// With -shard <index> <count>, the process regenerates the whole map from the
+// seed but only writes its share of the rows of the scaled map, with no
+// <dimension> line, to map.txt.shard.<index>.  -rows <start> <end> gives the
+// shard an explicit range of scaled rows instead.  Once every shard is done,
+// running with -merge <count> writes the <dimension> line and the shards, in
+// order, to map.txt.  The result is the same as a single process run.
+//
+// By default obstacles are placed anywhere and may overlap.  -nooverlap
+// rejects a placement that overlaps an obstacle already placed, -gap <cells>
+// also keeps that many open cells between obstacles, and -border <cells> keeps
+// obstacles that far from the edges.  A rejected obstacle is tried again at a
+// new position up to -retries <count> times.  The placed obstacles are kept in
+// a uniform grid so each check only looks at the nearby cells.
+//
+// -density <fraction> places obstacles until that fraction of the cells is
+// blocked, with <num_obstacles> as the limit.  The blocked cells are counted
+// per row as the obstacles are filled in, and the density of each band of
+// rows is reported.
+//
+// -scen <count> also writes map.txt.scen, a MovingAI style scenario file of
+// open start/goal pairs with their exact shortest path lengths, moving up,
+// down, left or right.  The lengths come from a breadth first search over the
+// scaled map packed 64 cells to a word, with the searches from different
+// starts spread over the threads.
 //
 #include <Windows.h>
+#include <io.h>
 #include <iostream>
+#include <new>
 #include <sstream>
 #include <string>
 #include <time.h>
 
-#define USAGE "MapGenerator <dimension> <num_obstacles> <obstacle_max_size> <num_threads> <scale_factor> <seed>\n\n"
+#define USAGE "MapGenerator <dimension> <num_obstacles> <obstacle_max_size> <num_threads> <scale_factor> <seed>"\
+	" [-resume | -verify | -shard <index> <count> [-rows <start> <end>] | -merge <count>]"\
+	" [-nooverlap] [-gap <cells>] [-border <cells>] [-retries <count>] [-density <fraction>] [-scen <count>]\n\n"
 
 #define OUTPUT_FILENAME "./map.txt"
+#define JOURNAL_FILENAME "./map.txt.journal"
+#define JOURNAL_SIGNATURE "MapGeneratorMT journal"
+#define MANIFEST_FILENAME "./map.txt.manifest"
+#define MANIFEST_SIGNATURE "MapGeneratorMT manifest"
+#define SHARD_FILENAME "./map.txt.shard"
+#define SHARD_SIGNATURE "MapGeneratorMT shard"
+#define SCENARIO_FILENAME "./map.txt.scen"
+#define SCENARIO_MAP_NAME "map.txt"
+
+// approximate size of the output written for one chunk in resumable mode
+#define RESUME_CHUNK_BYTES (256LL * 1024 * 1024)
+
+// obstacle placement with constraints
+#define DEFAULT_PLACEMENT_RETRIES 100
+#define PLACEMENT_BATCH_SIZE 4096
+
+// scenario output.  each search finds the distance to several goals, and
+// more goals than needed are drawn in case some can't be reached
+#define SCEN_MAX_DIMENSION 16384
+#define SCEN_GOALS_PER_START 10
+#define SCEN_GOAL_CANDIDATES 40
+#define SCEN_BUCKET_WIDTH 4
+#define SCEN_MAX_ROUNDS 8
 
 #define MAX(a, b) (a > b ? a : b)
 #define MIN(a, b) (a < b ? a : b)
@@ -30,9 +93,17 @@ using namespace std;
 
 bool initializeMap(char** pcMap, int iDimensionRows, int iDimensionCols);
 DWORD WINAPI addObstacle(LPVOID lpParam);
+DWORD WINAPI addObstacleConstrained(LPVOID lpParam);
+DWORD WINAPI checkPlacements(LPVOID lpParam);
+DWORD WINAPI checkPlacementsWorker(LPVOID lpParam);
+DWORD WINAPI searchScenarios(LPVOID lpParam);
 DWORD WINAPI printMap(LPVOID lpParam);
 DWORD WINAPI printMapScaled(LPVOID lpParam);
-bool combineMapFiles(FILE* pFile, int iDimension, int iScaleFactor);
+DWORD WINAPI printMapChunks(LPVOID lpParam);
+DWORD WINAPI hashMapScaled(LPVOID lpParam);
+DWORD WINAPI hashMapFile(LPVOID lpParam);
+int encodeMapRow(const char* pcMap, int iDimensionCols, int iRow, int iScaleFactor, char* pszLine);
+bool combineMapFiles(FILE* pFile, const char* pszFilename, int iNumFiles, bool bDeleteFiles);
 
 // for bitmap output
 const int bytesPerPixel = 3; /// red, green, blue
@@ -49,8 +120,60 @@ typedef struct _OBSTACLE_THREAD_ARGS
 	int iDimensionRows;
 	int iDimensionCols;
 	int iObstacleMaxSize;
+	bool bNoOverlap;
+	int iObstacleGap;                  // open cells required between obstacles
+	int iBorder;                       // open cells required next to the edges
+	int iRetries;
+	int* piRowBlocked;                 // obstacle cells in each row
+	long long llBlockedCells;
+	long long llTargetBlocked;         // stop once this many cells are blocked, 0 for no target
 } OBSTACLE_THREAD_ARGS;
 
+// an obstacle covering rows [iRow, iEndRow) and columns [iCol, iEndCol)
+typedef struct _OBSTACLE_RECT
+{
+	int iRow;
+	int iCol;
+	int iEndRow;
+	int iEndCol;
+	int iNext;                         // next obstacle in the same grid cell, or -1
+} OBSTACLE_RECT;
+
+// uniform grid of the placed obstacles.  each obstacle is listed in the
+// cell that holds its top left corner, newest first
+typedef struct _OBSTACLE_INDEX
+{
+	int iCellSize;
+	int iGridRows;
+	int iGridCols;
+	int* piCellHead;                   // first obstacle in each cell, or -1
+	OBSTACLE_RECT* pRects;
+	int iNumRects;
+	int iMaxRects;                     // pRects grows as the obstacles are placed
+	int iObstacleMaxSize;
+	int iObstacleGap;
+} OBSTACLE_INDEX;
+
+typedef struct _PLACEMENT_CANDIDATE
+{
+	OBSTACLE_RECT rect;
+	int iAttempts;
+	bool bActive;                      // the slot holds an obstacle still being placed
+	bool bClear;                       // the current position passed the checks so far
+} PLACEMENT_CANDIDATE;
+
+typedef struct _PLACEMENT_CHECK_ARGS
+{
+	const OBSTACLE_INDEX* pIndex;
+	PLACEMENT_CANDIDATE* pCandidates;
+	int iNumCandidates;
+	int iFirstGridRow;                 // only the candidates in these grid rows are checked
+	int iEndGridRow;
+	HANDLE hStartEvent;                // set when a batch is ready to check
+	HANDLE hDoneEvent;                 // set by the worker when its band is checked
+	bool bQuit;
+} PLACEMENT_CHECK_ARGS;
+
 typedef struct _FILE_WRITE_ARGS
 {
 	char** ppcMap;
@@ -61,13 +184,144 @@ typedef struct _FILE_WRITE_ARGS
 	int iStartLine;
 	int iEndLine;
 	int iScaleFactor;
+	long long llStartOutputLine;       // scaled lines outside this range are skipped
+	long long llEndOutputLine;
+	bool bDurable;                     // flush the file to disk before returning
+	long long llBytesWritten;          // set by the writer
+	unsigned long long ullChecksum;    // set by the writer
+	unsigned long long ullDigest;      // set by the writer, see hashMapLine
 } FILE_WRITE_ARGS;
 
+typedef struct _FILE_HASH_ARGS
+{
+	const char* pszFilename;
+	long long llDataOffset;            // where the first row starts
+	long long llRowBytes;              // bytes per row on disk, including the line end
+	int iRowLength;                    // characters per row, excluding the line end
+	int iStartLine;
+	int iEndLine;
+	bool bValid;                       // set by the reader
+	unsigned long long ullDigest;      // set by the reader
+} FILE_HASH_ARGS;
+
+// a scenario start and the goals drawn for it
+typedef struct _SCENARIO_START
+{
+	int iRow;
+	int iCol;
+	int iaGoalRows[SCEN_GOAL_CANDIDATES];
+	int iaGoalCols[SCEN_GOAL_CANDIDATES];
+	int iaDistances[SCEN_GOAL_CANDIDATES]; // set by the search, -1 if unreachable
+} SCENARIO_START;
+
+typedef struct _SCENARIO_PAIR
+{
+	int iBucket;
+	int iOrder;                        // keeps the sort stable
+	int iStartRow;
+	int iStartCol;
+	int iGoalRow;
+	int iGoalCol;
+	int iDistance;
+} SCENARIO_PAIR;
+
+typedef struct _SCENARIO_SEARCH_ARGS
+{
+	const unsigned long long* pullOpen;  // the scaled map, 1 bits are open
+	int iDimension;
+	int iWords;                        // words per row
+	SCENARIO_START* pStarts;
+	int iNumStarts;
+	unsigned long long* pullVisited;   // the search buffers of one thread, kept for every round
+	unsigned long long* pullFrontier;
+	unsigned long long* pullNext;
+	int* piFrontierWords;
+	int* piNextWords;
+} SCENARIO_SEARCH_ARGS;
+
+// everything that determines the content of the map
+typedef struct _GENERATOR_PARAMS
+{
+	int iDimension;
+	int iNumObstacles;
+	int iObstacleMaxSize;
+	int iScaleFactor;
+	int iSeed;
+	int iNoOverlap;
+	int iObstacleGap;
+	int iBorder;
+	int iRetries;
+	int iDensityPpm;                   // target density in parts per million, 0 for none
+} GENERATOR_PARAMS;
+
+// the journaled state of one chunk of rows in resumable mode
+typedef struct _CHUNK_RECORD
+{
+	bool bJournaled;
+	long long llBytes;
+	unsigned long long ullChecksum;
+	unsigned long long ullDigest;
+} CHUNK_RECORD;
+
+// for resumable output
+unsigned long long chainChecksum(unsigned long long ullChecksum, unsigned long long ullLineHash);
+void writeGeneratorParams(FILE* pFile, const GENERATOR_PARAMS* pParams);
+bool readGeneratorParam(const char* pszLine, GENERATOR_PARAMS* pParams);
+bool loadJournal(GENERATOR_PARAMS* pParams, int iChunkRows, int iNumChunks);
+bool openJournal(const GENERATOR_PARAMS* pParams, int iChunkRows);
+bool verifyChunkFile(int iChunk, int iMaxLineChars, long long llFirstLine);
+bool sameGeneratorParams(const GENERATOR_PARAMS* pFirst, const GENERATOR_PARAMS* pSecond);
+
+// for the map digest
+unsigned long long hashBytes(const unsigned char* pucData, size_t nLength);
+unsigned long long mixHash(unsigned long long ullHash);
+unsigned long long hashMapLine(unsigned long long ullLineHash, long long llLine);
+unsigned long long finishMapDigest(unsigned long long ullSum, int iFinalDimension);
+bool writeManifest(const GENERATOR_PARAMS* pParams, unsigned long long ullDigest);
+bool loadManifest(GENERATOR_PARAMS* pParams, unsigned long long* pullDigest);
+bool hashExistingMap(const char* pszFilename, int* piFinalDimension, unsigned long long* pullDigest);
+int verifyMap(char** ppcMap, const GENERATOR_PARAMS* pParams, bool bHaveManifest, unsigned long long ullManifestDigest);
+
+// for sharded output
+bool writeShardManifest(int iShard, const GENERATOR_PARAMS* pParams, long long llStartRow, long long llEndRow,
+	unsigned long long ullDigestSum);
+bool loadShardManifest(int iShard, GENERATOR_PARAMS* pParams, long long* pllStartRow, long long* pllEndRow,
+	unsigned long long* pullDigestSum);
+int mergeShards(GENERATOR_PARAMS* pParams, int iNumShards);
+bool copyShardFile(FILE* pFile, int iShard, int iMaxLineChars, long long llStartRow, unsigned long long* pullDigestSum);
+
+// for obstacle placement
+void paintObstacle(OBSTACLE_THREAD_ARGS* args, int iRow, int iCol, int iEndRow, int iEndCol);
+bool reachedTargetDensity(const OBSTACLE_THREAD_ARGS* args);
+void reportDensity(const OBSTACLE_THREAD_ARGS* args, int iNumBands);
+bool generateCandidate(OBSTACLE_THREAD_ARGS* args, OBSTACLE_RECT* pRect);
+bool isPlacementClear(const OBSTACLE_INDEX* pIndex, const OBSTACLE_RECT* pRect, int iFirstId);
+int randomBelow(int iRange);
+
+// for scenario output
+bool generateScenarios(char** ppcMap, int iDimension, int iScaleFactor, int iNumPairs);
+bool isOpenCell(const unsigned long long* pullOpen, int iWords, int iRow, int iCol);
+bool randomOpenCell(const unsigned long long* pullOpen, int iDimension, int iWords, int* piRow, int* piCol);
+int compareScenarioPairs(const void* pFirst, const void* pSecond);
+bool allocateSearchBuffers(SCENARIO_SEARCH_ARGS* args);
+void freeSearchBuffers(SCENARIO_SEARCH_ARGS* args);
+
 HANDLE ghMapMutex;
 HANDLE ghObstacleMutex;
+HANDLE ghJournalMutex;
+HANDLE ghScenarioMutex;
 int giNumObstaclesRemaining;
 int giNumThreads = 1;
 
+FILE* gpfJournal = NULL;
+CHUNK_RECORD* gpChunks = NULL;
+int giNumChunks = 0;
+int giChunkRows = 0;
+int giNextChunk = 0;
+bool gbJournalExists = false;
+
+int giNextScenarioStart = 0;
+
 /*-----------------------------------------------
 	
 -------------------------------------------------*/
@@ -76,8 +330,144 @@ int main(int argc, char* argv[])
 	time_t tStart = time(0);
 	time_t tEnd;
 
-	if (argc != 7)
+	if (argc < 7)
+	{
+		printf(USAGE);
+		return 1;
+	}
+
+	bool bResume = false;
+	bool bVerify = false;
+	int iShard = -1;
+	int iNumShards = 0;
+	bool bRowsGiven = false;
+	long long llShardStartRow = 0;
+	long long llShardEndRow = 0;
+	int iMergeShards = 0;
+	bool bNoOverlap = false;
+	int iObstacleGap = 0;
+	int iBorder = 0;
+	int iRetries = DEFAULT_PLACEMENT_RETRIES;
+	int iNumScenarios = 0;
+	int iDensityPpm = 0;
+	for (int i = 7; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-resume") == 0)
+		{
+			bResume = true;
+		}
+		else if (strcmp(argv[i], "-verify") == 0)
+		{
+			bVerify = true;
+		}
+		else if (strcmp(argv[i], "-shard") == 0 && i + 2 < argc)
+		{
+			iShard = atoi(argv[++i]);
+			iNumShards = atoi(argv[++i]);
+			if (iNumShards <= 0 || iShard < 0 || iShard >= iNumShards)
+			{
+				printf("The shard, %d of %d, is not valid.\n", iShard, iNumShards);
+				printf(USAGE);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-rows") == 0 && i + 2 < argc)
+		{
+			bRowsGiven = true;
+			llShardStartRow = atoll(argv[++i]);
+			llShardEndRow = atoll(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-nooverlap") == 0)
+		{
+			bNoOverlap = true;
+		}
+		else if (strcmp(argv[i], "-gap") == 0 && i + 1 < argc)
+		{
+			iObstacleGap = atoi(argv[++i]);
+			bNoOverlap = true;
+			if (iObstacleGap < 0)
+			{
+				printf("The obstacle gap, %s, is not valid.\n", argv[i]);
+				printf(USAGE);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-border") == 0 && i + 1 < argc)
+		{
+			iBorder = atoi(argv[++i]);
+			if (iBorder < 0)
+			{
+				printf("The border, %s, is not valid.\n", argv[i]);
+				printf(USAGE);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-retries") == 0 && i + 1 < argc)
+		{
+			iRetries = atoi(argv[++i]);
+			if (iRetries < 0)
+			{
+				printf("The number of retries, %s, is not valid.\n", argv[i]);
+				printf(USAGE);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-density") == 0 && i + 1 < argc)
+		{
+			// the target is kept in parts per million, so it has to round
+			// to something between 0 and 1 at that precision too
+			double dDensity = atof(argv[++i]);
+			iDensityPpm = (dDensity > 0.0 && dDensity < 1.0) ? (int)(dDensity * 1000000.0 + 0.5) : 0;
+			if (iDensityPpm <= 0 || iDensityPpm >= 1000000)
+			{
+				printf("The density, %s, is not valid.  It has to be between 0.000001 and 0.999999.\n", argv[i]);
+				printf(USAGE);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-scen") == 0 && i + 1 < argc)
+		{
+			iNumScenarios = atoi(argv[++i]);
+			if (iNumScenarios <= 0)
+			{
+				printf("The number of scenarios, %s, is not valid.\n", argv[i]);
+				printf(USAGE);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-merge") == 0 && i + 1 < argc)
+		{
+			iMergeShards = atoi(argv[++i]);
+			if (iMergeShards <= 0)
+			{
+				printf("The number of shards to merge, %s, is not valid.\n", argv[i]);
+				printf(USAGE);
+				return 1;
+			}
+		}
+		else
+		{
+			printf("Unknown option: %s\n", argv[i]);
+			printf(USAGE);
+			return 1;
+		}
+	}
+	bool bShard = iShard >= 0;
+	if ((bResume ? 1 : 0) + (bVerify ? 1 : 0) + (bShard ? 1 : 0) + (iMergeShards > 0 ? 1 : 0) > 1)
+	{
+		printf("Only one of -resume, -verify, -shard and -merge can be used.\n");
+		printf(USAGE);
+		return 1;
+	}
+	if (bRowsGiven && !bShard)
+	{
+		printf("-rows needs -shard to give the shard index.\n");
+		printf(USAGE);
+		return 1;
+	}
+	if (iNumScenarios > 0 && (bVerify || bShard || iMergeShards > 0))
 	{
+		printf("-scen can't be used with -verify, -shard or -merge.\n");
 		printf(USAGE);
 		return 1;
 	}
@@ -170,38 +560,189 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	if (iBorder > 0 && iDimension - 2 * iBorder <= iObstacleMaxSize)
+	{
+		printf("The border, %d, leaves no room for obstacles.\n", iBorder);
+		return 1;
+	}
+	bool bConstrained = bNoOverlap || iBorder > 0;
+	if (!bConstrained)
+	{
+		// the retries don't change the map unless there are constraints
+		iRetries = 0;
+	}
+
+	// the range of rows of the scaled map to write
+	long long llFinalDimension = (long long)iDimension * iScaleFactor;
+	if (iNumScenarios > 0 && llFinalDimension > SCEN_MAX_DIMENSION)
+	{
+		printf("Scenarios can only be generated for maps up to %d x %d.\n", SCEN_MAX_DIMENSION, SCEN_MAX_DIMENSION);
+		return 1;
+	}
+	long long llStartOutputLine = 0;
+	long long llEndOutputLine = llFinalDimension;
+	if (bShard)
+	{
+		if (bRowsGiven)
+		{
+			llStartOutputLine = llShardStartRow;
+			llEndOutputLine = llShardEndRow;
+		}
+		else
+		{
+			llStartOutputLine = llFinalDimension * iShard / iNumShards;
+			llEndOutputLine = llFinalDimension * (iShard + 1) / iNumShards;
+		}
+		if (llStartOutputLine < 0 || llEndOutputLine > llFinalDimension || llStartOutputLine >= llEndOutputLine)
+		{
+			printf("The rows, %lld to %lld, are not valid for a map of %lld rows.\n",
+				llStartOutputLine, llEndOutputLine, llFinalDimension);
+			return 1;
+		}
+		if (iSeed == 0)
+		{
+			printf("A seed is required with -shard so that every shard generates the same map.\n");
+			return 1;
+		}
+	}
+
+	GENERATOR_PARAMS params;
+	params.iDimension = iDimension;
+	params.iNumObstacles = iNumObstacles;
+	params.iObstacleMaxSize = iObstacleMaxSize;
+	params.iScaleFactor = iScaleFactor;
+	params.iSeed = iSeed;
+	params.iNoOverlap = bNoOverlap ? 1 : 0;
+	params.iObstacleGap = iObstacleGap;
+	params.iBorder = iBorder;
+	params.iRetries = iRetries;
+	params.iDensityPpm = iDensityPpm;
+
+	if (bResume)
+	{
+		// size the chunks so each one produces roughly RESUME_CHUNK_BYTES of output
+		long long llBytesPerRow = (long long)iScaleFactor * ((long long)iDimension * iScaleFactor * 2 + 1);
+		giChunkRows = (int)MAX(1, MIN(RESUME_CHUNK_BYTES / llBytesPerRow, (long long)iDimension));
+		giNumChunks = (iDimension + giChunkRows - 1) / giChunkRows;
+
+		// picks up the seed from an existing journal if none was given
+		if (!loadJournal(&params, giChunkRows, giNumChunks))
+		{
+			return 1;
+		}
+		iSeed = params.iSeed;
+	}
+
+	bool bHaveManifest = false;
+	unsigned long long ullManifestDigest = 0;
+	if (bVerify)
+	{
+		bool bSeedGiven = iSeed != 0;
+		GENERATOR_PARAMS manifestParams;
+		bHaveManifest = loadManifest(&manifestParams, &ullManifestDigest);
+		if (bHaveManifest && iSeed == 0)
+		{
+			// verify against the seed the map was generated with
+			iSeed = manifestParams.iSeed;
+			params.iSeed = iSeed;
+		}
+		if (bHaveManifest && !sameGeneratorParams(&manifestParams, &params))
+		{
+			fprintf(stdout, "The manifest %s was written with different parameters:\n", MANIFEST_FILENAME);
+			writeGeneratorParams(stdout, &manifestParams);
+			bHaveManifest = false;
+		}
+		if (!bHaveManifest && !bSeedGiven)
+		{
+			printf("A seed is required with -verify when there is no manifest to take it from.\n");
+			return 1;
+		}
+	}
+
+	if (iMergeShards > 0)
+	{
+		// the map isn't generated, only the shards are combined
+		return mergeShards(&params, iMergeShards);
+	}
+
 	// use the user-supplied seed if given
 	if (iSeed == 0)
 	{
 		iSeed = (int)time(0);
+		params.iSeed = iSeed;
 	}
 	srand((unsigned int)iSeed);
 
+	if (bResume && !openJournal(&params, giChunkRows))
+	{
+		return 1;
+	}
+
 	// print the arguments
 	fprintf(stdout, "\n");
 	fprintf(stdout, "Dimension: %d\n", iDimension);
 	fprintf(stdout, "Obstacles: %d\n", iNumObstacles);
 	fprintf(stdout, "Obstacle Max Size: %d x %d\n", iObstacleMaxSize, iObstacleMaxSize);
+	if (bConstrained)
+	{
+		fprintf(stdout, "Obstacle Constraints: %s, gap %d, border %d, %d retries\n",
+			bNoOverlap ? "no overlap" : "overlap allowed", iObstacleGap, iBorder, iRetries);
+	}
+	if (iDensityPpm > 0)
+	{
+		fprintf(stdout, "Target Density: %.2f%%, at most %d obstacles\n", iDensityPpm / 10000.0, iNumObstacles);
+	}
 	fprintf(stdout, "Number of Threads: %d\n", giNumThreads);
 	fprintf(stdout, "Scale Factor: %d\n", iScaleFactor);
 	fprintf(stdout, "Seed: %d\n", iSeed);
 	fprintf(stdout, "Final Dimension: %d x %d\n", (iDimension * iScaleFactor), (iDimension * iScaleFactor));
+	if (bResume)
+	{
+		fprintf(stdout, "Resumable: %d chunks of %d rows, journal %s\n", giNumChunks, giChunkRows, JOURNAL_FILENAME);
+	}
+	if (bShard)
+	{
+		fprintf(stdout, "Shard: %d of %d, rows %lld to %lld\n", iShard, iNumShards, llStartOutputLine, llEndOutputLine);
+	}
 	fprintf(stdout, "\n");
 
-	// make sure the output file doesn't already exist
-	struct stat statbuf;
-	if (stat(OUTPUT_FILENAME, &statbuf) == 0)
+	// a shard is written to its own file, without the dimension
+	char szOutputFilename[MAX_PATH];
+	if (bShard)
+	{
+		sprintf_s(szOutputFilename, MAX_PATH, "%s.%d", SHARD_FILENAME, iShard);
+	}
+	else
 	{
-		//fprintf(stdout, "The file %s already exists.  Remove it and rerun.\n", OUTPUT_FILENAME);
-		//return 1;
-		fprintf(stdout, "The file %s already exists.  It will be deleted.\n", OUTPUT_FILENAME);
+		sprintf_s(szOutputFilename, MAX_PATH, "%s", OUTPUT_FILENAME);
 	}
 
-	FILE* pfOutputFile;
-	if ((fopen_s(&pfOutputFile, OUTPUT_FILENAME, "w")) != 0)
+	FILE* pfOutputFile = NULL;
+	if (!bVerify)
 	{
-		fprintf(stdout, "Unable to open the output map file for writing: %s\n", OUTPUT_FILENAME);
-		return 1;
+		// make sure the output file doesn't already exist
+		struct stat statbuf;
+		if (stat(szOutputFilename, &statbuf) == 0)
+		{
+			//fprintf(stdout, "The file %s already exists.  Remove it and rerun.\n", szOutputFilename);
+			//return 1;
+			fprintf(stdout, "The file %s already exists.  It will be deleted.\n", szOutputFilename);
+		}
+
+		if (bShard)
+		{
+			// the manifest from an earlier run is only written again once the
+			// shard is complete, so until then the merge won't take the shard
+			char szShardManifest[MAX_PATH];
+			sprintf_s(szShardManifest, MAX_PATH, "%s.%d.manifest", SHARD_FILENAME, iShard);
+			remove(szShardManifest);
+		}
+
+		if ((fopen_s(&pfOutputFile, szOutputFilename, "w")) != 0)
+		{
+			fprintf(stdout, "Unable to open the output map file for writing: %s\n", szOutputFilename);
+			return 1;
+		}
 	}
 
 	char* pcMap = NULL;
@@ -244,37 +785,96 @@ int main(int argc, char* argv[])
 		printf("CreateMutex error: %d\n", GetLastError());
 		return 1;
 	}
+	ghJournalMutex = CreateMutex(NULL, FALSE, NULL);
+	if (ghJournalMutex == NULL)
+	{
+		printf("CreateMutex error: %d\n", GetLastError());
+		return 1;
+	}
+	ghScenarioMutex = CreateMutex(NULL, FALSE, NULL);
+	if (ghScenarioMutex == NULL)
+	{
+		printf("CreateMutex error: %d\n", GetLastError());
+		return 1;
+	}
 
 	OBSTACLE_THREAD_ARGS args;
 	args.ppcMap = &pcMap;
 	args.iDimensionCols = iDimension;
 	args.iDimensionRows = iDimension;
 	args.iObstacleMaxSize = iObstacleMaxSize;
-	addObstacle(&args);
+	args.bNoOverlap = bNoOverlap;
+	args.iObstacleGap = iObstacleGap;
+	args.iBorder = iBorder;
+	args.iRetries = iRetries;
+	args.piRowBlocked = new int[iDimension];
+	memset(args.piRowBlocked, 0, iDimension * sizeof(int));
+	args.llBlockedCells = 0;
+	args.llTargetBlocked = ((long long)iDimension * iDimension * iDensityPpm + 999999) / 1000000;
+	if (bConstrained)
+	{
+		addObstacleConstrained(&args);
+	}
+	else
+	{
+		addObstacle(&args);
+	}
+	// the bands are only of interest when the placement is being steered
+	reportDensity(&args, (iDensityPpm > 0 || bConstrained) ? giNumThreads : 0);
+	if (iDensityPpm > 0 && !reachedTargetDensity(&args))
+	{
+		fprintf(stdout, "Warning: all %d obstacles were used before reaching the target density.\n", iNumObstacles);
+	}
+	delete[] args.piRowBlocked;
+
+	if (bVerify)
+	{
+		int iRc = verifyMap(&pcMap, &params, bHaveManifest, ullManifestDigest);
+
+		delete[] pcMap;
+		delete[] phThreads;
+		for (int i = 0; i < giNumThreads; i++)
+		{
+			delete fileargs[i];
+		}
+		delete[] fileargs;
+		CloseHandle(ghMapMutex);
+		CloseHandle(ghObstacleMutex);
+		CloseHandle(ghJournalMutex);
+		CloseHandle(ghScenarioMutex);
+		return iRc;
+	}
 
-	// start threads to write out sections of the map
+	// start threads to write out sections of the map.  a shard only
+	// needs the unscaled rows that cover its scaled rows
 	DWORD dwThreadId;
-	int iLinesPerFile = iDimension / giNumThreads;
-	int iRemainingLines = iDimension - (iLinesPerFile * giNumThreads);
+	int iFirstRow = (int)(llStartOutputLine / iScaleFactor);
+	int iLastRow = (int)((llEndOutputLine + iScaleFactor - 1) / iScaleFactor);
+	int iLinesPerFile = (iLastRow - iFirstRow) / giNumThreads;
+	int iRemainingLines = (iLastRow - iFirstRow) - (iLinesPerFile * giNumThreads);
 	for (int i = 0; i < giNumThreads; i++)
 	{
 		fileargs[i]->ppcMap = &pcMap;
 		fileargs[i]->iDimensionCols = iDimension;
 		fileargs[i]->iDimensionRows = iDimension;
-		fileargs[i]->pszFilename = OUTPUT_FILENAME;
+		fileargs[i]->pszFilename = szOutputFilename;
 		fileargs[i]->iSuffix = i;
-		fileargs[i]->iStartLine = i * iLinesPerFile;
+		fileargs[i]->iStartLine = iFirstRow + i * iLinesPerFile;
 		fileargs[i]->iEndLine = fileargs[i]->iStartLine + iLinesPerFile;
 		if (i + 1 >= giNumThreads)
 		{
 			fileargs[i]->iEndLine += iRemainingLines;
 		}
 		fileargs[i]->iScaleFactor = iScaleFactor;
+		fileargs[i]->llStartOutputLine = llStartOutputLine;
+		fileargs[i]->llEndOutputLine = llEndOutputLine;
+		fileargs[i]->bDurable = false;
 
 		phThreads[i] = CreateThread(
 			NULL,       // default security attributes
 			0,          // default stack size
-			(LPTHREAD_START_ROUTINE)printMapScaled,
+			// in resumable mode the threads take chunks from a shared queue instead
+			bResume ? (LPTHREAD_START_ROUTINE)printMapChunks : (LPTHREAD_START_ROUTINE)printMapScaled,
 			fileargs[i],       // thread function arguments
 			0,          // default creation flags
 			&dwThreadId); // receive thread identifier
@@ -299,16 +899,100 @@ int main(int argc, char* argv[])
 		delete[] phThreads;
 	}
 
-	// combine the separate map files into one
-	combineMapFiles(pfOutputFile, iDimension, iScaleFactor);
+	if (bResume)
+	{
+		int iIncomplete = 0;
+		for (int i = 0; i < giNumChunks; i++)
+		{
+			if (!gpChunks[i].bJournaled)
+			{
+				iIncomplete++;
+			}
+		}
+		if (iIncomplete > 0)
+		{
+			fprintf(stdout, "%d of %d chunks were not written.  Rerun with -resume to finish the map.\n",
+				iIncomplete, giNumChunks);
+			return 1;
+		}
+	}
+
+	// the digest is the same however the rows were split up
+	unsigned long long ullDigestSum = 0;
+	for (int i = 0; i < (bResume ? giNumChunks : giNumThreads); i++)
+	{
+		ullDigestSum += bResume ? gpChunks[i].ullDigest : fileargs[i]->ullDigest;
+	}
+	unsigned long long ullDigest = finishMapDigest(ullDigestSum, iDimension * iScaleFactor);
+
+	// first write out the dimension, unless this is a shard
+	if (!bShard)
+	{
+		fprintf(pfOutputFile, "%d\n", iDimension * iScaleFactor);
+	}
+
+	// combine the separate map files into one.  in resumable mode the chunk
+	// files are kept until the combined file is safely on disk
+	bool bCombined = bResume ?
+		combineMapFiles(pfOutputFile, szOutputFilename, giNumChunks, false) :
+		combineMapFiles(pfOutputFile, szOutputFilename, giNumThreads, true);
 
 	if (pfOutputFile != NULL)
 	{
+		if (bResume)
+		{
+			fflush(pfOutputFile);
+			_commit(_fileno(pfOutputFile));
+		}
 		fclose(pfOutputFile);
 	}
 
-	// create a bitmap image of the map.  it will be upside down
-	createBitmap(&pcMap, iDimension, iDimension, (char*) "./image.bmp");
+	if (bResume)
+	{
+		if (!bCombined)
+		{
+			fprintf(stdout, "Unable to combine the chunk files.  Rerun with -resume to finish the map.\n");
+			return 1;
+		}
+
+		// the journal goes first, so if this is interrupted the map is
+		// complete and a rerun doesn't find a journal with missing chunks
+		fclose(gpfJournal);
+		gpfJournal = NULL;
+		remove(JOURNAL_FILENAME);
+		char szFilename[MAX_PATH];
+		for (int i = 0; i < giNumChunks; i++)
+		{
+			sprintf_s(szFilename, MAX_PATH, "%s.%d", OUTPUT_FILENAME, i);
+			remove(szFilename);
+		}
+		fprintf(stdout, "Removed the chunk files and %s\n", JOURNAL_FILENAME);
+	}
+
+	if (bShard)
+	{
+		// the shard digests are added together by the merge
+		if (bCombined && writeShardManifest(iShard, &params, llStartOutputLine, llEndOutputLine, ullDigestSum))
+		{
+			fprintf(stdout, "Shard written: %s\n", szOutputFilename);
+		}
+	}
+	else
+	{
+		fprintf(stdout, "Digest: %016llx\n", ullDigest);
+		if (bCombined && writeManifest(&params, ullDigest))
+		{
+			fprintf(stdout, "Manifest written: %s\n", MANIFEST_FILENAME);
+		}
+
+		// create a bitmap image of the map.  it will be upside down
+		createBitmap(&pcMap, iDimension, iDimension, (char*) "./image.bmp");
+
+		if (iNumScenarios > 0)
+		{
+			generateScenarios(&pcMap, iDimension, iScaleFactor, iNumScenarios);
+		}
+	}
 
 	// cleanup
 	if (pcMap)
@@ -318,6 +1002,13 @@ int main(int argc, char* argv[])
 
 	CloseHandle(ghMapMutex);
 	CloseHandle(ghObstacleMutex);
+	CloseHandle(ghJournalMutex);
+	CloseHandle(ghScenarioMutex);
+
+	if (gpChunks)
+	{
+		delete[] gpChunks;
+	}
 
 	for (int i = 0; i < giNumThreads; i++)
 	{
@@ -469,23 +1160,32 @@ DWORD WINAPI printMapScaled(LPVOID lpParam)
 	}
 	pszLine[0] = '\0';
 
+	args->llBytesWritten = 0;
+	args->ullChecksum = 0;
+	args->ullDigest = 0;
+
 	int iLinesWritten = 0;
-	char szChars[3];
 	for (int i = args->iStartLine; i < args->iEndLine; i++) // for each row
 	{
-		pszLine[0] = '\0';
-		for (int j = 0; j < args->iDimensionCols; j++) // for each column
+		size_t nLineLength = encodeMapRow(*args->ppcMap, args->iDimensionCols, i, args->iScaleFactor, pszLine);
+
+		// every scaled copy of the row has the same text, so it's only hashed once
+		unsigned long long ullLineHash = hashBytes((const unsigned char*)pszLine, nLineLength);
+		for (int k = 0; k < args->iScaleFactor; k++)
 		{
-			sprintf_s(szChars, sizeof(szChars), "%1c ", *(*args->ppcMap + i * args->iDimensionRows + j));
-			for (int k = 0; k < args->iScaleFactor; k++)
+			long long llLine = (long long)i * args->iScaleFactor + k;
+			if (llLine < args->llStartOutputLine || llLine >= args->llEndOutputLine)
 			{
-				strcat_s(pszLine, iMaxLineChars, szChars);
+				continue;
 			}
-		}
 
-		for (int k = 0; k < args->iScaleFactor; k++)
-		{
 			fprintf(pFile, "%s\n", pszLine);
+			args->ullDigest += hashMapLine(ullLineHash, llLine);
+			if (args->bDurable)
+			{
+				args->ullChecksum = chainChecksum(args->ullChecksum, ullLineHash);
+			}
+			args->llBytesWritten += nLineLength + 1;
 			iLinesWritten++;
 			if (iLinesWritten % 500 == 0)
 			{
@@ -494,6 +1194,17 @@ DWORD WINAPI printMapScaled(LPVOID lpParam)
 		}
 	}
 
+	if (args->bDurable)
+	{
+		if (ferror(pFile) || fflush(pFile) != 0 || _commit(_fileno(pFile)) != 0)
+		{
+			fprintf(stdout, "Thread id %d Failed to write the map file to disk: %s\n",
+				GetCurrentThreadId(), szFilename);
+			fclose(pFile);
+			delete[] pszLine;
+			return 1;
+		}
+	}
 	fclose(pFile);
 
 	delete[] pszLine;
@@ -502,165 +1213,1980 @@ DWORD WINAPI printMapScaled(LPVOID lpParam)
 }
 
 /*-----------------------------------------------
-	Combine the individual map files created by the
-	threads into a single file.
+	Build the text of one row of the map, scaled.
+	Returns the number of characters.
 -------------------------------------------------*/
-bool combineMapFiles(FILE* pFile, int iDimension, int iScaleFactor)
+int encodeMapRow(const char* pcMap, int iDimensionCols, int iRow, int iScaleFactor, char* pszLine)
 {
-	bool bRc = false;
-#define CHUNK_SIZE 65536
-	unsigned char ucaBuffer[CHUNK_SIZE];
-
-	if (pFile == NULL)
+	char* pszNext = pszLine;
+	for (int j = 0; j < iDimensionCols; j++) // for each column
 	{
-		return false;
+		char cCell = *(pcMap + iRow * iDimensionCols + j);
+		for (int k = 0; k < iScaleFactor; k++)
+		{
+			*pszNext++ = cCell;
+			*pszNext++ = ' ';
+		}
 	}
+	*pszNext = '\0';
+	return (int)(pszNext - pszLine);
+}
 
-	fprintf(stdout, "Combining separate maps files into %s\n", OUTPUT_FILENAME);
-
-	// first write out the dimension
-	fprintf(pFile, "%d\n", iDimension * iScaleFactor);
+/*-----------------------------------------------
+	Compute the digest of a range of lines of the
+	map, scaled, without writing them anywhere.
+-------------------------------------------------*/
+DWORD WINAPI hashMapScaled(LPVOID lpParam)
+{
+	FILE_WRITE_ARGS* args = (FILE_WRITE_ARGS*)lpParam;
 
-	char szFilename[MAX_PATH];
-	for (int i = 0; i < giNumThreads; i++)
+	args->ullDigest = 0;
+	if ((args->iEndLine < args->iStartLine) || !args->ppcMap || args->iDimensionCols <= 0)
 	{
-		sprintf_s(szFilename, MAX_PATH, "%s.%d", OUTPUT_FILENAME, i);
-		FILE* pInput;
+		return 1;
+	}
+
+	char* pszLine = new char[args->iDimensionCols * 2 * args->iScaleFactor + 16];
+	for (int i = args->iStartLine; i < args->iEndLine; i++) // for each row
+	{
+		size_t nLineLength = encodeMapRow(*args->ppcMap, args->iDimensionCols, i, args->iScaleFactor, pszLine);
+		unsigned long long ullLineHash = hashBytes((const unsigned char*)pszLine, nLineLength);
+		for (int k = 0; k < args->iScaleFactor; k++)
+		{
+			long long llLine = (long long)i * args->iScaleFactor + k;
+			if (llLine >= args->llStartOutputLine && llLine < args->llEndOutputLine)
+			{
+				args->ullDigest += hashMapLine(ullLineHash, llLine);
+			}
+		}
+	}
+	delete[] pszLine;
+
+	return 0;
+}
+
+/*-----------------------------------------------
+	Compute the digest of a range of rows of an
+	existing map file.  All rows must be the
+	same length.
+-------------------------------------------------*/
+DWORD WINAPI hashMapFile(LPVOID lpParam)
+{
+	FILE_HASH_ARGS* args = (FILE_HASH_ARGS*)lpParam;
+
+	args->bValid = false;
+	args->ullDigest = 0;
+
+	FILE* pFile;
+	if (fopen_s(&pFile, args->pszFilename, "rb") != 0)
+	{
+		fprintf(stdout, "Thread id %d Unable to open the map file: %s\n", GetCurrentThreadId(), args->pszFilename);
+		return 1;
+	}
+	if (_fseeki64(pFile, args->llDataOffset + args->iStartLine * args->llRowBytes, SEEK_SET) != 0)
+	{
+		fclose(pFile);
+		return 1;
+	}
+
+	unsigned char* pucRow = new unsigned char[(size_t)args->llRowBytes];
+	bool bValid = true;
+	for (int i = args->iStartLine; i < args->iEndLine && bValid; i++) // for each row
+	{
+		if (fread_s(pucRow, (size_t)args->llRowBytes, 1, (size_t)args->llRowBytes, pFile) != (size_t)args->llRowBytes ||
+			pucRow[args->llRowBytes - 1] != '\n')
+		{
+			fprintf(stdout, "Thread id %d Row %d of %s is not the expected length\n", GetCurrentThreadId(), i, args->pszFilename);
+			bValid = false;
+			break;
+		}
+		args->ullDigest += hashMapLine(hashBytes(pucRow, args->iRowLength), i);
+	}
+	fclose(pFile);
+	delete[] pucRow;
+
+	args->bValid = bValid;
+	return 0;
+}
+
+/*-----------------------------------------------
+	Resumable mode.  Take chunks of rows from the
+	shared queue, skipping any that are already
+	journaled and verify, and write the rest.
+	Each written chunk is added to the journal.
+-------------------------------------------------*/
+DWORD WINAPI printMapChunks(LPVOID lpParam)
+{
+	FILE_WRITE_ARGS* args = (FILE_WRITE_ARGS*)lpParam;
+
+	while (true)
+	{
+		int iChunk = giNumChunks;
+		DWORD dwWaitResult = WaitForSingleObject(ghJournalMutex, INFINITE);
+		if (dwWaitResult == WAIT_OBJECT_0)
+		{
+			iChunk = giNextChunk++;
+		}
+		ReleaseMutex(ghJournalMutex);
+
+		if (iChunk >= giNumChunks)
+		{
+			break;
+		}
+
+		if (gpChunks[iChunk].bJournaled)
+		{
+			if (verifyChunkFile(iChunk, args->iDimensionRows * 2 * args->iScaleFactor + 16,
+				(long long)iChunk * giChunkRows * args->iScaleFactor))
+			{
+				fprintf(stdout, "Thread id %d Chunk %d is already complete\n", GetCurrentThreadId(), iChunk);
+				continue;
+			}
+			fprintf(stdout, "Thread id %d Chunk %d is missing or corrupt, regenerating it\n", GetCurrentThreadId(), iChunk);
+			gpChunks[iChunk].bJournaled = false;
+		}
+
+		args->iSuffix = iChunk;
+		args->iStartLine = iChunk * giChunkRows;
+		args->iEndLine = MIN(args->iStartLine + giChunkRows, args->iDimensionRows);
+		args->bDurable = true;
+		if (printMapScaled(args) != 0)
+		{
+			return 1;
+		}
+
+		dwWaitResult = WaitForSingleObject(ghJournalMutex, INFINITE);
+		if (dwWaitResult == WAIT_OBJECT_0)
+		{
+			fprintf(gpfJournal, "chunk %d %lld %016llx %016llx\n",
+				iChunk, args->llBytesWritten, args->ullChecksum, args->ullDigest);
+			if (fflush(gpfJournal) == 0 && _commit(_fileno(gpfJournal)) == 0)
+			{
+				gpChunks[iChunk].bJournaled = true;
+				gpChunks[iChunk].llBytes = args->llBytesWritten;
+				gpChunks[iChunk].ullChecksum = args->ullChecksum;
+				gpChunks[iChunk].ullDigest = args->ullDigest;
+			}
+			else
+			{
+				fprintf(stdout, "Thread id %d Failed to update the journal for chunk %d\n", GetCurrentThreadId(), iChunk);
+			}
+		}
+		ReleaseMutex(ghJournalMutex);
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------
+	Combine the individual map files created by the
+	threads, <pszFilename>.0, .1, ..., into a single
+	file.  The files are deleted as they are copied
+	if bDeleteFiles is set.
+-------------------------------------------------*/
+bool combineMapFiles(FILE* pFile, const char* pszFilename, int iNumFiles, bool bDeleteFiles)
+{
+	bool bRc = false;
+#define CHUNK_SIZE 65536
+	unsigned char ucaBuffer[CHUNK_SIZE];
+
+	if (pFile == NULL)
+	{
+		return false;
+	}
+
+	fprintf(stdout, "Combining separate maps files %s.0 to %s.%d\n", pszFilename, pszFilename, iNumFiles - 1);
+
+	char szFilename[MAX_PATH];
+	for (int i = 0; i < iNumFiles; i++)
+	{
+		sprintf_s(szFilename, MAX_PATH, "%s.%d", pszFilename, i);
+		FILE* pInput;
 		if (fopen_s(&pInput, szFilename, "r") != 0)
 		{
 			fprintf(stdout, "Failed to open one of the map files: %s\n", szFilename);
 			return false;
 		}
 
-		size_t nTotalRead = 0;
-		size_t nTotalWritten = 0;
-		size_t nCharsWritten;
-		size_t nCharsRead = fread_s(ucaBuffer, CHUNK_SIZE, sizeof(unsigned char), CHUNK_SIZE, pInput);
-		while (nCharsRead > 0)
+		size_t nTotalRead = 0;
+		size_t nTotalWritten = 0;
+		size_t nCharsWritten;
+		size_t nCharsRead = fread_s(ucaBuffer, CHUNK_SIZE, sizeof(unsigned char), CHUNK_SIZE, pInput);
+		while (nCharsRead > 0)
+		{
+			nTotalRead += nCharsRead;
+			nCharsWritten = fwrite(ucaBuffer, sizeof(unsigned char), nCharsRead, pFile);
+			nTotalWritten += nCharsWritten;
+			nCharsRead = fread_s(ucaBuffer, CHUNK_SIZE, sizeof(unsigned char), CHUNK_SIZE, pInput);
+		}
+		fclose(pInput);
+		//fprintf(stdout, "%s - %ld chars read, %ld chars written\n", szFilename, (long) nTotalRead, (long) nTotalWritten);
+		if (bDeleteFiles)
+		{
+			fprintf(stdout, "Deleting temporary file %s\n", szFilename);
+			remove(szFilename);
+		}
+	}
+
+	bRc = !ferror(pFile);
+	return bRc;
+}
+
+/*-----------------------------------------------
+	Add the hash of the next line of a chunk file
+	to its running checksum, starting from 0.
+	Unlike the digest it depends on the order of
+	the lines, and it reuses the line hash so a
+	scaled copy of a row costs nothing extra.
+-------------------------------------------------*/
+unsigned long long chainChecksum(unsigned long long ullChecksum, unsigned long long ullLineHash)
+{
+	return mixHash(ullChecksum ^ ullLineHash);
+}
+
+/*-----------------------------------------------
+	Write the generator parameters as
+	"<name> <value>" lines
+-------------------------------------------------*/
+void writeGeneratorParams(FILE* pFile, const GENERATOR_PARAMS* pParams)
+{
+	fprintf(pFile, "dimension %d\n", pParams->iDimension);
+	fprintf(pFile, "obstacles %d\n", pParams->iNumObstacles);
+	fprintf(pFile, "obstacle_max_size %d\n", pParams->iObstacleMaxSize);
+	fprintf(pFile, "scale_factor %d\n", pParams->iScaleFactor);
+	fprintf(pFile, "seed %d\n", pParams->iSeed);
+	fprintf(pFile, "no_overlap %d\n", pParams->iNoOverlap);
+	fprintf(pFile, "obstacle_gap %d\n", pParams->iObstacleGap);
+	fprintf(pFile, "border %d\n", pParams->iBorder);
+	fprintf(pFile, "retries %d\n", pParams->iRetries);
+	fprintf(pFile, "density_ppm %d\n", pParams->iDensityPpm);
+}
+
+/*-----------------------------------------------
+	Parse one line written by writeGeneratorParams.
+	Returns false if it isn't a parameter line.
+-------------------------------------------------*/
+bool readGeneratorParam(const char* pszLine, GENERATOR_PARAMS* pParams)
+{
+	const char* pszValue = strchr(pszLine, ' ');
+	if (pszValue == NULL || pszValue - pszLine >= 64)
+	{
+		return false;
+	}
+
+	char szName[64];
+	memcpy(szName, pszLine, pszValue - pszLine);
+	szName[pszValue - pszLine] = '\0';
+	int iValue = atoi(pszValue + 1);
+
+	if (strcmp(szName, "dimension") == 0)
+	{
+		pParams->iDimension = iValue;
+	}
+	else if (strcmp(szName, "obstacles") == 0)
+	{
+		pParams->iNumObstacles = iValue;
+	}
+	else if (strcmp(szName, "obstacle_max_size") == 0)
+	{
+		pParams->iObstacleMaxSize = iValue;
+	}
+	else if (strcmp(szName, "scale_factor") == 0)
+	{
+		pParams->iScaleFactor = iValue;
+	}
+	else if (strcmp(szName, "seed") == 0)
+	{
+		pParams->iSeed = iValue;
+	}
+	else if (strcmp(szName, "no_overlap") == 0)
+	{
+		pParams->iNoOverlap = iValue;
+	}
+	else if (strcmp(szName, "obstacle_gap") == 0)
+	{
+		pParams->iObstacleGap = iValue;
+	}
+	else if (strcmp(szName, "border") == 0)
+	{
+		pParams->iBorder = iValue;
+	}
+	else if (strcmp(szName, "retries") == 0)
+	{
+		pParams->iRetries = iValue;
+	}
+	else if (strcmp(szName, "density_ppm") == 0)
+	{
+		pParams->iDensityPpm = iValue;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+/*-----------------------------------------------
+	Read the journal left by an earlier resumable
+	run, if there is one, and mark the chunks it
+	completed.  The parameters must match the
+	journal; a seed of 0 takes the journal's seed.
+-------------------------------------------------*/
+bool loadJournal(GENERATOR_PARAMS* pParams, int iChunkRows, int iNumChunks)
+{
+	gpChunks = new CHUNK_RECORD[iNumChunks];
+	for (int i = 0; i < iNumChunks; i++)
+	{
+		gpChunks[i].bJournaled = false;
+		gpChunks[i].llBytes = 0;
+		gpChunks[i].ullChecksum = 0;
+		gpChunks[i].ullDigest = 0;
+	}
+
+	FILE* pJournal;
+	if (fopen_s(&pJournal, JOURNAL_FILENAME, "r") != 0)
+	{
+		// nothing to resume
+		gbJournalExists = false;
+		return true;
+	}
+	gbJournalExists = true;
+
+	GENERATOR_PARAMS journalParams;
+	memset(&journalParams, 0, sizeof(journalParams));
+	int iJournalChunkRows = 0;
+	int iChunksFound = 0;
+
+	char szLine[256];
+	if (fgets(szLine, sizeof(szLine), pJournal) == NULL ||
+		strncmp(szLine, JOURNAL_SIGNATURE, strlen(JOURNAL_SIGNATURE)) != 0)
+	{
+		fprintf(stdout, "%s is not a map journal.  Remove it and rerun.\n", JOURNAL_FILENAME);
+		fclose(pJournal);
+		return false;
+	}
+
+	while (fgets(szLine, sizeof(szLine), pJournal) != NULL)
+	{
+		int iChunk;
+		long long llBytes;
+		unsigned long long ullChecksum;
+		unsigned long long ullDigest;
+		if (sscanf_s(szLine, "chunk %d %lld %llx %llx", &iChunk, &llBytes, &ullChecksum, &ullDigest) == 4)
+		{
+			// a chunk that was rewritten appears again later in the journal
+			if (iChunk >= 0 && iChunk < iNumChunks)
+			{
+				if (!gpChunks[iChunk].bJournaled)
+				{
+					iChunksFound++;
+				}
+				gpChunks[iChunk].bJournaled = true;
+				gpChunks[iChunk].llBytes = llBytes;
+				gpChunks[iChunk].ullChecksum = ullChecksum;
+				gpChunks[iChunk].ullDigest = ullDigest;
+			}
+		}
+		else if (strncmp(szLine, "chunk_rows ", 11) == 0)
+		{
+			iJournalChunkRows = atoi(szLine + 11);
+		}
+		else
+		{
+			readGeneratorParam(szLine, &journalParams);
+		}
+	}
+	fclose(pJournal);
+
+	if (pParams->iSeed == 0)
+	{
+		pParams->iSeed = journalParams.iSeed;
+	}
+
+	if (!sameGeneratorParams(&journalParams, pParams) || iJournalChunkRows != iChunkRows)
+	{
+		fprintf(stdout, "The journal %s was written with different parameters:\n", JOURNAL_FILENAME);
+		writeGeneratorParams(stdout, &journalParams);
+		fprintf(stdout, "Rerun with those parameters, or remove the journal to start over.\n");
+		return false;
+	}
+
+	fprintf(stdout, "Resuming from %s: %d of %d chunks were written\n", JOURNAL_FILENAME, iChunksFound, iNumChunks);
+	return true;
+}
+
+/*-----------------------------------------------
+	Open the journal for appending chunk records,
+	starting a new one if loadJournal didn't find one
+-------------------------------------------------*/
+bool openJournal(const GENERATOR_PARAMS* pParams, int iChunkRows)
+{
+	if (fopen_s(&gpfJournal, JOURNAL_FILENAME, gbJournalExists ? "a" : "w") != 0)
+	{
+		fprintf(stdout, "Unable to open the journal for writing: %s\n", JOURNAL_FILENAME);
+		return false;
+	}
+
+	if (!gbJournalExists)
+	{
+		fprintf(gpfJournal, "%s\n", JOURNAL_SIGNATURE);
+		writeGeneratorParams(gpfJournal, pParams);
+		fprintf(gpfJournal, "chunk_rows %d\n", iChunkRows);
+		if (fflush(gpfJournal) != 0 || _commit(_fileno(gpfJournal)) != 0)
+		{
+			fprintf(stdout, "Unable to write the journal: %s\n", JOURNAL_FILENAME);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*-----------------------------------------------
+	Check a chunk file against its journal record.
+	The digest is checked as well as the checksum,
+	since it goes into the manifest as it is.
+	llFirstLine is the chunk's first output line.
+-------------------------------------------------*/
+bool verifyChunkFile(int iChunk, int iMaxLineChars, long long llFirstLine)
+{
+	char szFilename[MAX_PATH];
+	sprintf_s(szFilename, MAX_PATH, "%s.%d", OUTPUT_FILENAME, iChunk);
+
+	FILE* pInput;
+	if (fopen_s(&pInput, szFilename, "r") != 0)
+	{
+		return false;
+	}
+
+	char* pszLine = new char[iMaxLineChars];
+	if (pszLine == NULL)
+	{
+		fclose(pInput);
+		return false;
+	}
+
+	// a line that's too long is split and won't match the checksum
+	long long llBytes = 0;
+	long long llLine = llFirstLine;
+	unsigned long long ullChecksum = 0;
+	unsigned long long ullDigest = 0;
+	while (fgets(pszLine, iMaxLineChars, pInput) != NULL)
+	{
+		size_t nLineLength = strlen(pszLine);
+		llBytes += nLineLength;
+		if (nLineLength > 0 && pszLine[nLineLength - 1] == '\n')
+		{
+			nLineLength--;
+		}
+		unsigned long long ullLineHash = hashBytes((const unsigned char*)pszLine, nLineLength);
+		ullChecksum = chainChecksum(ullChecksum, ullLineHash);
+		ullDigest += hashMapLine(ullLineHash, llLine++);
+	}
+	fclose(pInput);
+	delete[] pszLine;
+
+	return llBytes == gpChunks[iChunk].llBytes && ullChecksum == gpChunks[iChunk].ullChecksum &&
+		ullDigest == gpChunks[iChunk].ullDigest;
+}
+
+/*-----------------------------------------------
+	Returns true if both sets of parameters
+	generate the same map
+-------------------------------------------------*/
+bool sameGeneratorParams(const GENERATOR_PARAMS* pFirst, const GENERATOR_PARAMS* pSecond)
+{
+	return pFirst->iDimension == pSecond->iDimension &&
+		pFirst->iNumObstacles == pSecond->iNumObstacles &&
+		pFirst->iObstacleMaxSize == pSecond->iObstacleMaxSize &&
+		pFirst->iScaleFactor == pSecond->iScaleFactor &&
+		pFirst->iSeed == pSecond->iSeed &&
+		pFirst->iNoOverlap == pSecond->iNoOverlap &&
+		pFirst->iObstacleGap == pSecond->iObstacleGap &&
+		pFirst->iBorder == pSecond->iBorder &&
+		pFirst->iRetries == pSecond->iRetries &&
+		pFirst->iDensityPpm == pSecond->iDensityPpm;
+}
+
+/*-----------------------------------------------
+	Fast non-cryptographic hash of a block of
+	bytes, 8 bytes at a time
+-------------------------------------------------*/
+unsigned long long hashBytes(const unsigned char* pucData, size_t nLength)
+{
+	const unsigned long long ullMultiplier = 0x9E3779B97F4A7C15ULL;
+	unsigned long long ullHash = nLength * ullMultiplier;
+	unsigned long long ullWord;
+
+	size_t i = 0;
+	for (; i + 8 <= nLength; i += 8)
+	{
+		memcpy(&ullWord, pucData + i, 8);
+		ullHash = (ullHash ^ ullWord) * ullMultiplier;
+		ullHash ^= ullHash >> 29;
+	}
+	ullWord = 0;
+	memcpy(&ullWord, pucData + i, nLength - i);
+	ullHash = (ullHash ^ ullWord) * ullMultiplier;
+
+	return mixHash(ullHash);
+}
+
+/*-----------------------------------------------
+	Scramble the bits of a hash (splitmix64)
+-------------------------------------------------*/
+unsigned long long mixHash(unsigned long long ullHash)
+{
+	ullHash ^= ullHash >> 30;
+	ullHash *= 0xBF58476D1CE4E5B9ULL;
+	ullHash ^= ullHash >> 27;
+	ullHash *= 0x94D049BB133111EBULL;
+	ullHash ^= ullHash >> 31;
+	return ullHash;
+}
+
+/*-----------------------------------------------
+	The contribution of one line of the output to
+	the map digest.  The contributions are added
+	together, so the digest is the same however the
+	lines are split between threads, and the line
+	number is mixed in so swapped lines are caught.
+-------------------------------------------------*/
+unsigned long long hashMapLine(unsigned long long ullLineHash, long long llLine)
+{
+	return mixHash(ullLineHash ^ mixHash((unsigned long long)llLine + 1));
+}
+
+/*-----------------------------------------------
+	Turn the sum of the line contributions into
+	the digest of the whole map file
+-------------------------------------------------*/
+unsigned long long finishMapDigest(unsigned long long ullSum, int iFinalDimension)
+{
+	return mixHash(ullSum ^ mixHash((unsigned long long)iFinalDimension));
+}
+
+/*-----------------------------------------------
+	Record the parameters and digest of the map
+-------------------------------------------------*/
+bool writeManifest(const GENERATOR_PARAMS* pParams, unsigned long long ullDigest)
+{
+	FILE* pManifest;
+	if (fopen_s(&pManifest, MANIFEST_FILENAME, "w") != 0)
+	{
+		fprintf(stdout, "Unable to open the manifest for writing: %s\n", MANIFEST_FILENAME);
+		return false;
+	}
+
+	fprintf(pManifest, "%s\n", MANIFEST_SIGNATURE);
+	writeGeneratorParams(pManifest, pParams);
+	fprintf(pManifest, "final_dimension %d\n", pParams->iDimension * pParams->iScaleFactor);
+	fprintf(pManifest, "digest %016llx\n", ullDigest);
+
+	bool bRc = !ferror(pManifest);
+	fclose(pManifest);
+	return bRc;
+}
+
+/*-----------------------------------------------
+	Read the manifest written with the map.
+	Returns false if there isn't one.
+-------------------------------------------------*/
+bool loadManifest(GENERATOR_PARAMS* pParams, unsigned long long* pullDigest)
+{
+	memset(pParams, 0, sizeof(GENERATOR_PARAMS));
+	*pullDigest = 0;
+
+	FILE* pManifest;
+	if (fopen_s(&pManifest, MANIFEST_FILENAME, "r") != 0)
+	{
+		fprintf(stdout, "There is no manifest, %s\n", MANIFEST_FILENAME);
+		return false;
+	}
+
+	char szLine[256];
+	if (fgets(szLine, sizeof(szLine), pManifest) == NULL ||
+		strncmp(szLine, MANIFEST_SIGNATURE, strlen(MANIFEST_SIGNATURE)) != 0)
+	{
+		fprintf(stdout, "%s is not a map manifest\n", MANIFEST_FILENAME);
+		fclose(pManifest);
+		return false;
+	}
+
+	bool bHaveDigest = false;
+	while (fgets(szLine, sizeof(szLine), pManifest) != NULL)
+	{
+		if (sscanf_s(szLine, "digest %llx", pullDigest) == 1)
+		{
+			bHaveDigest = true;
+		}
+		else
+		{
+			readGeneratorParam(szLine, pParams);
+		}
+	}
+	fclose(pManifest);
+
+	return bHaveDigest;
+}
+
+/*-----------------------------------------------
+	Compute the digest of an existing map file,
+	reading it with giNumThreads threads
+-------------------------------------------------*/
+bool hashExistingMap(const char* pszFilename, int* piFinalDimension, unsigned long long* pullDigest)
+{
+	FILE* pFile;
+	if (fopen_s(&pFile, pszFilename, "rb") != 0)
+	{
+		fprintf(stdout, "Unable to open the map file: %s\n", pszFilename);
+		return false;
+	}
+
+	// the rows start after the dimension, and they are all as long as the first
+	char szHeader[64];
+	if (fgets(szHeader, sizeof(szHeader), pFile) == NULL || atoi(szHeader) <= 0)
+	{
+		fprintf(stdout, "%s doesn't start with the map dimension\n", pszFilename);
+		fclose(pFile);
+		return false;
+	}
+	int iFinalDimension = atoi(szHeader);
+	long long llDataOffset = (long long)strlen(szHeader);
+
+	long long llRowBytes = 0;
+	int iChar;
+	int iPrevious = 0;
+	while ((iChar = fgetc(pFile)) != EOF)
+	{
+		llRowBytes++;
+		if (iChar == '\n')
+		{
+			break;
+		}
+		iPrevious = iChar;
+	}
+	// text files written on Windows end the lines with \r\n
+	int iRowLength = (int)(llRowBytes - (iPrevious == '\r' ? 2 : 1));
+
+	_fseeki64(pFile, 0, SEEK_END);
+	long long llFileSize = _ftelli64(pFile);
+	fclose(pFile);
+
+	if (iChar != '\n' || llFileSize != llDataOffset + iFinalDimension * llRowBytes)
+	{
+		fprintf(stdout, "%s doesn't have %d rows of the same length\n", pszFilename, iFinalDimension);
+		return false;
+	}
+
+	HANDLE* phThreads = new HANDLE[giNumThreads];
+	FILE_HASH_ARGS* hashargs = new FILE_HASH_ARGS[giNumThreads];
+
+	DWORD dwThreadId;
+	int iLinesPerThread = iFinalDimension / giNumThreads;
+	for (int i = 0; i < giNumThreads; i++)
+	{
+		hashargs[i].pszFilename = pszFilename;
+		hashargs[i].llDataOffset = llDataOffset;
+		hashargs[i].llRowBytes = llRowBytes;
+		hashargs[i].iRowLength = iRowLength;
+		hashargs[i].iStartLine = i * iLinesPerThread;
+		hashargs[i].iEndLine = (i + 1 >= giNumThreads) ? iFinalDimension : hashargs[i].iStartLine + iLinesPerThread;
+		hashargs[i].bValid = false;
+
+		phThreads[i] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)hashMapFile, &hashargs[i], 0, &dwThreadId);
+		if (phThreads[i] == NULL)
+		{
+			printf("CreateThread error: %d\n", GetLastError());
+			return false;
+		}
+	}
+
+	WaitForMultipleObjects(giNumThreads, phThreads, TRUE, INFINITE);
+
+	bool bValid = true;
+	unsigned long long ullDigestSum = 0;
+	for (int i = 0; i < giNumThreads; i++)
+	{
+		CloseHandle(phThreads[i]);
+		bValid = bValid && hashargs[i].bValid;
+		ullDigestSum += hashargs[i].ullDigest;
+	}
+	delete[] phThreads;
+	delete[] hashargs;
+
+	*piFinalDimension = iFinalDimension;
+	*pullDigest = finishMapDigest(ullDigestSum, iFinalDimension);
+	return bValid;
+}
+
+/*-----------------------------------------------
+	Verify mode.  Compare the digest of the map
+	regenerated from the seed, the digest of the
+	existing map file and the digest in the
+	manifest.  Returns 0 if they all agree.
+-------------------------------------------------*/
+int verifyMap(char** ppcMap, const GENERATOR_PARAMS* pParams, bool bHaveManifest, unsigned long long ullManifestDigest)
+{
+	HANDLE* phThreads = new HANDLE[giNumThreads];
+	FILE_WRITE_ARGS* hashargs = new FILE_WRITE_ARGS[giNumThreads];
+
+	fprintf(stdout, "Hashing the regenerated map\n");
+
+	DWORD dwThreadId;
+	int iLinesPerThread = pParams->iDimension / giNumThreads;
+	for (int i = 0; i < giNumThreads; i++)
+	{
+		hashargs[i].ppcMap = ppcMap;
+		hashargs[i].iDimensionRows = pParams->iDimension;
+		hashargs[i].iDimensionCols = pParams->iDimension;
+		hashargs[i].iStartLine = i * iLinesPerThread;
+		hashargs[i].iEndLine = (i + 1 >= giNumThreads) ? pParams->iDimension : hashargs[i].iStartLine + iLinesPerThread;
+		hashargs[i].iScaleFactor = pParams->iScaleFactor;
+		hashargs[i].llStartOutputLine = 0;
+		hashargs[i].llEndOutputLine = (long long)pParams->iDimension * pParams->iScaleFactor;
+
+		phThreads[i] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)hashMapScaled, &hashargs[i], 0, &dwThreadId);
+		if (phThreads[i] == NULL)
+		{
+			printf("CreateThread error: %d\n", GetLastError());
+			return 1;
+		}
+	}
+
+	WaitForMultipleObjects(giNumThreads, phThreads, TRUE, INFINITE);
+
+	unsigned long long ullDigestSum = 0;
+	for (int i = 0; i < giNumThreads; i++)
+	{
+		CloseHandle(phThreads[i]);
+		ullDigestSum += hashargs[i].ullDigest;
+	}
+	delete[] phThreads;
+	delete[] hashargs;
+
+	unsigned long long ullExpectedDigest = finishMapDigest(ullDigestSum, pParams->iDimension * pParams->iScaleFactor);
+	fprintf(stdout, "Regenerated digest: %016llx\n", ullExpectedDigest);
+
+	bool bMatch = true;
+	if (bHaveManifest)
+	{
+		fprintf(stdout, "Manifest digest:    %016llx\n", ullManifestDigest);
+		bMatch = bMatch && (ullManifestDigest == ullExpectedDigest);
+	}
+
+	fprintf(stdout, "Hashing %s\n", OUTPUT_FILENAME);
+	int iFinalDimension = 0;
+	unsigned long long ullFileDigest = 0;
+	if (hashExistingMap(OUTPUT_FILENAME, &iFinalDimension, &ullFileDigest))
+	{
+		fprintf(stdout, "Map file digest:    %016llx\n", ullFileDigest);
+		bMatch = bMatch && (ullFileDigest == ullExpectedDigest);
+	}
+	else
+	{
+		bMatch = false;
+	}
+
+	fprintf(stdout, bMatch ? "Verified: the map matches\n" : "FAILED: the map does not match\n");
+	return bMatch ? 0 : 1;
+}
+
+
+/*-----------------------------------------------
+	Record which rows a shard holds and the sum of
+	their line digests, for the merge
+-------------------------------------------------*/
+bool writeShardManifest(int iShard, const GENERATOR_PARAMS* pParams, long long llStartRow, long long llEndRow,
+	unsigned long long ullDigestSum)
+{
+	char szFilename[MAX_PATH];
+	sprintf_s(szFilename, MAX_PATH, "%s.%d.manifest", SHARD_FILENAME, iShard);
+
+	FILE* pManifest;
+	if (fopen_s(&pManifest, szFilename, "w") != 0)
+	{
+		fprintf(stdout, "Unable to open the shard manifest for writing: %s\n", szFilename);
+		return false;
+	}
+
+	fprintf(pManifest, "%s\n", SHARD_SIGNATURE);
+	writeGeneratorParams(pManifest, pParams);
+	fprintf(pManifest, "start_row %lld\n", llStartRow);
+	fprintf(pManifest, "end_row %lld\n", llEndRow);
+	fprintf(pManifest, "digest_sum %016llx\n", ullDigestSum);
+
+	bool bRc = !ferror(pManifest);
+	fclose(pManifest);
+	return bRc;
+}
+
+/*-----------------------------------------------
+	Read the manifest written with a shard.
+	Returns false if it's missing or incomplete.
+-------------------------------------------------*/
+bool loadShardManifest(int iShard, GENERATOR_PARAMS* pParams, long long* pllStartRow, long long* pllEndRow,
+	unsigned long long* pullDigestSum)
+{
+	memset(pParams, 0, sizeof(GENERATOR_PARAMS));
+
+	char szFilename[MAX_PATH];
+	sprintf_s(szFilename, MAX_PATH, "%s.%d.manifest", SHARD_FILENAME, iShard);
+
+	FILE* pManifest;
+	if (fopen_s(&pManifest, szFilename, "r") != 0)
+	{
+		fprintf(stdout, "Shard %d isn't finished, %s is missing\n", iShard, szFilename);
+		return false;
+	}
+
+	char szLine[256];
+	if (fgets(szLine, sizeof(szLine), pManifest) == NULL ||
+		strncmp(szLine, SHARD_SIGNATURE, strlen(SHARD_SIGNATURE)) != 0)
+	{
+		fprintf(stdout, "%s is not a shard manifest\n", szFilename);
+		fclose(pManifest);
+		return false;
+	}
+
+	int iFound = 0;
+	while (fgets(szLine, sizeof(szLine), pManifest) != NULL)
+	{
+		if (sscanf_s(szLine, "start_row %lld", pllStartRow) == 1 ||
+			sscanf_s(szLine, "end_row %lld", pllEndRow) == 1 ||
+			sscanf_s(szLine, "digest_sum %llx", pullDigestSum) == 1)
+		{
+			iFound++;
+		}
+		else
+		{
+			readGeneratorParam(szLine, pParams);
+		}
+	}
+	fclose(pManifest);
+
+	if (iFound != 3)
+	{
+		fprintf(stdout, "%s is incomplete\n", szFilename);
+		return false;
+	}
+	return true;
+}
+
+/*-----------------------------------------------
+	Merge mode.  Check that the shards were made
+	with these parameters and cover every row
+	once, then write the dimension and the shards
+	to the output file.  Each shard's lines are
+	hashed as they're copied and checked against
+	its manifest, so a shard file that was cut
+	short isn't merged.  A seed of 0 takes the
+	shards' seed.
+-------------------------------------------------*/
+int mergeShards(GENERATOR_PARAMS* pParams, int iNumShards)
+{
+	long long llFinalDimension = (long long)pParams->iDimension * pParams->iScaleFactor;
+	long long llNextRow = 0;
+	unsigned long long ullDigestSum = 0;
+	long long* pllStartRows = new long long[iNumShards];
+	unsigned long long* pullShardDigestSums = new unsigned long long[iNumShards];
+
+	for (int i = 0; i < iNumShards; i++)
+	{
+		GENERATOR_PARAMS shardParams;
+		long long llStartRow = 0;
+		long long llEndRow = 0;
+		unsigned long long ullShardDigestSum = 0;
+		if (!loadShardManifest(i, &shardParams, &llStartRow, &llEndRow, &ullShardDigestSum))
+		{
+			delete[] pllStartRows;
+			delete[] pullShardDigestSums;
+			return 1;
+		}
+
+		if (pParams->iSeed == 0)
+		{
+			pParams->iSeed = shardParams.iSeed;
+		}
+		if (!sameGeneratorParams(&shardParams, pParams))
+		{
+			fprintf(stdout, "Shard %d was generated with different parameters:\n", i);
+			writeGeneratorParams(stdout, &shardParams);
+			delete[] pllStartRows;
+			delete[] pullShardDigestSums;
+			return 1;
+		}
+		if (llStartRow != llNextRow)
+		{
+			fprintf(stdout, "Shard %d starts at row %lld, but the previous shards end at row %lld\n",
+				i, llStartRow, llNextRow);
+			delete[] pllStartRows;
+			delete[] pullShardDigestSums;
+			return 1;
+		}
+
+		llNextRow = llEndRow;
+		ullDigestSum += ullShardDigestSum;
+		pllStartRows[i] = llStartRow;
+		pullShardDigestSums[i] = ullShardDigestSum;
+	}
+
+	if (llNextRow != llFinalDimension)
+	{
+		fprintf(stdout, "The shards end at row %lld, but the map has %lld rows\n", llNextRow, llFinalDimension);
+		delete[] pllStartRows;
+		delete[] pullShardDigestSums;
+		return 1;
+	}
+
+	// the manifest of an earlier merge no longer describes map.txt
+	remove(MANIFEST_FILENAME);
+
+	FILE* pfOutputFile;
+	if ((fopen_s(&pfOutputFile, OUTPUT_FILENAME, "w")) != 0)
+	{
+		fprintf(stdout, "Unable to open the output map file for writing: %s\n", OUTPUT_FILENAME);
+		delete[] pllStartRows;
+		delete[] pullShardDigestSums;
+		return 1;
+	}
+
+	fprintf(stdout, "Merging shards %s.0 to %s.%d\n", SHARD_FILENAME, SHARD_FILENAME, iNumShards - 1);
+	fprintf(pfOutputFile, "%lld\n", llFinalDimension);
+	bool bCombined = true;
+	for (int i = 0; i < iNumShards && bCombined; i++)
+	{
+		unsigned long long ullCopiedDigestSum = 0;
+		bCombined = copyShardFile(pfOutputFile, i, (int)llFinalDimension * 2 + 16, pllStartRows[i], &ullCopiedDigestSum);
+		if (bCombined && ullCopiedDigestSum != pullShardDigestSums[i])
+		{
+			fprintf(stdout, "Shard %d doesn't match its manifest.  Rerun the shard, then merge again.\n", i);
+			bCombined = false;
+		}
+	}
+	bCombined = !ferror(pfOutputFile) && bCombined;
+	fclose(pfOutputFile);
+	delete[] pllStartRows;
+	delete[] pullShardDigestSums;
+	if (!bCombined)
+	{
+		// don't leave a partial map that looks finished
+		remove(OUTPUT_FILENAME);
+		fprintf(stdout, "Unable to merge the shards into %s\n", OUTPUT_FILENAME);
+		return 1;
+	}
+
+	// the same digest as a single process run
+	unsigned long long ullDigest = finishMapDigest(ullDigestSum, (int)llFinalDimension);
+	fprintf(stdout, "Merged %d shards into %s\n", iNumShards, OUTPUT_FILENAME);
+	fprintf(stdout, "Digest: %016llx\n", ullDigest);
+	if (writeManifest(pParams, ullDigest))
+	{
+		fprintf(stdout, "Manifest written: %s\n", MANIFEST_FILENAME);
+	}
+	return 0;
+}
+
+/*-----------------------------------------------
+	Append a shard file to the merged map, adding
+	up the line digests of what was copied.
+	llStartRow is the shard's first scaled row.
+-------------------------------------------------*/
+bool copyShardFile(FILE* pFile, int iShard, int iMaxLineChars, long long llStartRow, unsigned long long* pullDigestSum)
+{
+	char szFilename[MAX_PATH];
+	sprintf_s(szFilename, MAX_PATH, "%s.%d", SHARD_FILENAME, iShard);
+
+	FILE* pInput;
+	if (fopen_s(&pInput, szFilename, "r") != 0)
+	{
+		fprintf(stdout, "Failed to open one of the shard files: %s\n", szFilename);
+		return false;
+	}
+
+	char* pszLine = new char[iMaxLineChars];
+	if (pszLine == NULL)
+	{
+		fclose(pInput);
+		return false;
+	}
+
+	// a line that's too long is split and won't match the digest
+	bool bRc = true;
+	long long llLine = llStartRow;
+	*pullDigestSum = 0;
+	while (fgets(pszLine, iMaxLineChars, pInput) != NULL)
+	{
+		fputs(pszLine, pFile);
+		size_t nLineLength = strlen(pszLine);
+		if (nLineLength == 0 || pszLine[nLineLength - 1] != '\n')
+		{
+			fprintf(stdout, "%s ends part way through a line\n", szFilename);
+			bRc = false;
+			break;
+		}
+		*pullDigestSum += hashMapLine(hashBytes((const unsigned char*)pszLine, nLineLength - 1), llLine++);
+	}
+	fclose(pInput);
+	delete[] pszLine;
+
+	return bRc;
+}
+
+/*-----------------------------------------------
+	Add an obstacle/wall to the map.  
+	Returns true if the obstacle was added.
+-------------------------------------------------*/
+DWORD WINAPI addObstacle(LPVOID lpParam)
+{
+	OBSTACLE_THREAD_ARGS* args = (OBSTACLE_THREAD_ARGS*) lpParam;
+	bool bContinue = true;
+
+	if (!args->ppcMap || args->iDimensionRows <= 0 || args->iDimensionCols <= 0)
+	{
+		return false;
+	}
+
+	fprintf(stdout, "Thread id %d Generating obstacles of max size %d x %d\n",
+		GetCurrentThreadId(), args->iObstacleMaxSize, args->iObstacleMaxSize);
+
+	while (bContinue)
+	{
+		DWORD dwWaitResult = WaitForSingleObject(ghObstacleMutex, INFINITE);
+		if (dwWaitResult == WAIT_OBJECT_0)
+		{
+			if (giNumObstaclesRemaining > 0 && !reachedTargetDensity(args))
+			{
+				giNumObstaclesRemaining--;
+				//fprintf(stdout, "%d obstacles remaining\n", giNumObstaclesRemaining);
+			}
+			else
+			{
+				bContinue = false;
+			}
+		}
+		else
+		{
+			bContinue = false;
+		}
+		ReleaseMutex(ghObstacleMutex);
+
+		if (!bContinue)
+		{
+			return 1;
+		}
+
+		//fprintf(stdout, "Thread id %d is working\n", GetCurrentThreadId());
+
+		// pick a random width and height > 0 for the new obstacle
+		int iWidth;
+		int iHeight;
+		while (true)
+		{
+			iWidth = rand() % args->iObstacleMaxSize;
+			if (iWidth > 0)
+			{
+				break;
+			}
+		}
+		while (true)
+		{
+			iHeight = rand() % args->iObstacleMaxSize;
+			if (iHeight > 0)
+			{
+				break;
+			}
+		}
+
+		// pick a random row and column > 0 and < max for the new obstacle
+		int iRow;
+		int iCol;
+		while (true)
+		{
+			iRow = rand() % (args->iDimensionRows - 1);
+			if (iRow > 0)
+			{
+				break;
+			}
+		}
+		while (true)
+		{
+			iCol = rand() % (args->iDimensionCols - 1);
+			if (iCol > 0)
+			{
+				break;
+			}
+		}
+
+		//fprintf(stdout, "Thread id %d Obstacle at row %d, col %d of width %d, height %d\n", 
+		//	GetCurrentThreadId(), iRow, iCol, iWidth, iHeight);
+
+		int iEndRow = MIN((iRow + iHeight), args->iDimensionRows);
+		int iEndCol = MIN((iCol + iWidth), args->iDimensionCols);
+
+		dwWaitResult = WaitForSingleObject(ghMapMutex, INFINITE);
+		if (dwWaitResult == WAIT_OBJECT_0)
+		{
+			paintObstacle(args, iRow, iCol, iEndRow, iEndCol);
+		}
+		ReleaseMutex(ghMapMutex);
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------
+	Fill in an obstacle on the map, counting the
+	cells that were open before
+-------------------------------------------------*/
+void paintObstacle(OBSTACLE_THREAD_ARGS* args, int iRow, int iCol, int iEndRow, int iEndCol)
+{
+	for (int i = iRow; i < iEndRow; i++)
+	{
+		char* pcCell = *args->ppcMap + i * args->iDimensionCols + iCol;
+		int iNewlyBlocked = 0;
+		for (int j = iCol; j < iEndCol; j++, pcCell++)
+		{
+			iNewlyBlocked += (*pcCell == cOPEN_CHAR);
+			*pcCell = cOBSTACLE_CHAR;
+		}
+		args->piRowBlocked[i] += iNewlyBlocked;
+		args->llBlockedCells += iNewlyBlocked;
+	}
+}
+
+/*-----------------------------------------------
+	Returns true if there is a target density and
+	enough cells are blocked to reach it
+-------------------------------------------------*/
+bool reachedTargetDensity(const OBSTACLE_THREAD_ARGS* args)
+{
+	return args->llTargetBlocked > 0 && args->llBlockedCells >= args->llTargetBlocked;
+}
+
+/*-----------------------------------------------
+	Print the fraction of blocked cells for the
+	whole map and for each band of rows, the same
+	bands the writer threads use.  With 0 bands
+	only the whole map is printed.
+-------------------------------------------------*/
+void reportDensity(const OBSTACLE_THREAD_ARGS* args, int iNumBands)
+{
+	long long llCells = (long long)args->iDimensionRows * args->iDimensionCols;
+	fprintf(stdout, "Blocked: %lld of %lld cells, density %.4f\n",
+		args->llBlockedCells, llCells, (double)args->llBlockedCells / llCells);
+	if (iNumBands <= 0)
+	{
+		return;
+	}
+
+	int iRowsPerBand = args->iDimensionRows / iNumBands;
+	for (int b = 0; b < iNumBands; b++)
+	{
+		int iStartRow = b * iRowsPerBand;
+		int iEndRow = (b + 1 >= iNumBands) ? args->iDimensionRows : iStartRow + iRowsPerBand;
+		long long llBandBlocked = 0;
+		for (int i = iStartRow; i < iEndRow; i++)
+		{
+			llBandBlocked += args->piRowBlocked[i];
+		}
+		long long llBandCells = (long long)(iEndRow - iStartRow) * args->iDimensionCols;
+		fprintf(stdout, "  Rows %d to %d: density %.4f\n", iStartRow, iEndRow,
+			llBandCells > 0 ? (double)llBandBlocked / llBandCells : 0.0);
+	}
+}
+
+/*-----------------------------------------------
+	Add obstacles to the map subject to the
+	no overlap, gap and border constraints.
+
+	The obstacles are placed in batches.  The
+	positions are drawn from rand() in order, the
+	checks against the obstacles already placed run
+	in parallel with each thread taking a band of
+	the grid, and then the clear ones are placed in
+	order after checking them against the ones
+	placed earlier in the same batch.  The map is
+	the same whatever the number of threads.
+-------------------------------------------------*/
+DWORD WINAPI addObstacleConstrained(LPVOID lpParam)
+{
+	OBSTACLE_THREAD_ARGS* args = (OBSTACLE_THREAD_ARGS*) lpParam;
+
+	if (!args->ppcMap || args->iDimensionRows <= 0 || args->iDimensionCols <= 0)
+	{
+		return false;
+	}
+
+	fprintf(stdout, "Thread id %d Generating obstacles of max size %d x %d with constraints\n",
+		GetCurrentThreadId(), args->iObstacleMaxSize, args->iObstacleMaxSize);
+
+	// a cell is big enough that only the neighbouring cells need checking
+	OBSTACLE_INDEX index;
+	index.iObstacleMaxSize = args->iObstacleMaxSize;
+	index.iObstacleGap = args->iObstacleGap;
+	index.iCellSize = args->iObstacleMaxSize + args->iObstacleGap;
+	index.iGridRows = (args->iDimensionRows + index.iCellSize - 1) / index.iCellSize;
+	index.iGridCols = (args->iDimensionCols + index.iCellSize - 1) / index.iCellSize;
+	index.piCellHead = new int[index.iGridRows * index.iGridCols];
+	for (int i = 0; i < index.iGridRows * index.iGridCols; i++)
+	{
+		index.piCellHead[i] = -1;
+	}
+	// with -density the number of obstacles is only a limit, so the list
+	// starts small instead of holding every obstacle that might be placed
+	index.iMaxRects = MAX(1, MIN(giNumObstaclesRemaining, PLACEMENT_BATCH_SIZE));
+	index.pRects = new OBSTACLE_RECT[index.iMaxRects];
+	index.iNumRects = 0;
+
+	PLACEMENT_CANDIDATE* pCandidates = new PLACEMENT_CANDIDATE[PLACEMENT_BATCH_SIZE];
+	for (int i = 0; i < PLACEMENT_BATCH_SIZE; i++)
+	{
+		pCandidates[i].bActive = false;
+	}
+
+	// this thread checks the first band.  the other bands have workers
+	// that are started once and woken for each batch
+	int iNumWorkers = args->bNoOverlap ? giNumThreads - 1 : 0;
+	HANDLE* phThreads = new HANDLE[giNumThreads];
+	HANDLE* phDoneEvents = new HANDLE[giNumThreads];
+	PLACEMENT_CHECK_ARGS* checkargs = new PLACEMENT_CHECK_ARGS[giNumThreads];
+	for (int t = 0; t < giNumThreads; t++)
+	{
+		checkargs[t].pIndex = &index;
+		checkargs[t].pCandidates = pCandidates;
+		checkargs[t].iNumCandidates = PLACEMENT_BATCH_SIZE;
+		checkargs[t].iFirstGridRow = index.iGridRows * t / giNumThreads;
+		checkargs[t].iEndGridRow = index.iGridRows * (t + 1) / giNumThreads;
+		checkargs[t].hStartEvent = NULL;
+		checkargs[t].hDoneEvent = NULL;
+		checkargs[t].bQuit = false;
+	}
+	for (int w = 0; w < iNumWorkers; w++)
+	{
+		PLACEMENT_CHECK_ARGS* pWorkerArgs = &checkargs[w + 1];
+		pWorkerArgs->hStartEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		pWorkerArgs->hDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (pWorkerArgs->hStartEvent == NULL || pWorkerArgs->hDoneEvent == NULL)
+		{
+			printf("CreateEvent error: %d\n", GetLastError());
+			return 1;
+		}
+		phDoneEvents[w] = pWorkerArgs->hDoneEvent;
+
+		DWORD dwThreadId;
+		phThreads[w] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)checkPlacementsWorker, pWorkerArgs, 0, &dwThreadId);
+		if (phThreads[w] == NULL)
+		{
+			printf("CreateThread error: %d\n", GetLastError());
+			return 1;
+		}
+	}
+
+	int iFailed = 0;
+	long long llAttempts = 0;
+	while (true)
+	{
+		// draw a position for every obstacle in the batch, taking new
+		// obstacles for the slots that were placed or gave up
+		int iActive = 0;
+		for (int i = 0; i < PLACEMENT_BATCH_SIZE; i++)
+		{
+			if (!pCandidates[i].bActive)
+			{
+				if (giNumObstaclesRemaining <= 0)
+				{
+					continue;
+				}
+				giNumObstaclesRemaining--;
+				pCandidates[i].bActive = true;
+				pCandidates[i].iAttempts = 0;
+			}
+
+			pCandidates[i].bClear = generateCandidate(args, &pCandidates[i].rect);
+			pCandidates[i].iAttempts++;
+			llAttempts++;
+			iActive++;
+		}
+
+		if (iActive == 0)
+		{
+			break;
+		}
+
+		// check against the obstacles placed in earlier batches
+		if (args->bNoOverlap)
+		{
+			for (int w = 0; w < iNumWorkers; w++)
+			{
+				SetEvent(checkargs[w + 1].hStartEvent);
+			}
+			checkPlacements(&checkargs[0]);
+			if (iNumWorkers > 0)
+			{
+				WaitForMultipleObjects(iNumWorkers, phDoneEvents, TRUE, INFINITE);
+			}
+		}
+
+		// place the clear ones in order
+		int iBatchFirstId = index.iNumRects;
+		for (int i = 0; i < PLACEMENT_BATCH_SIZE; i++)
+		{
+			PLACEMENT_CANDIDATE* pCandidate = &pCandidates[i];
+			if (!pCandidate->bActive)
+			{
+				continue;
+			}
+			if (reachedTargetDensity(args))
+			{
+				// the rest of the batch isn't needed
+				pCandidate->bActive = false;
+				giNumObstaclesRemaining = 0;
+				continue;
+			}
+
+			if (pCandidate->bClear && args->bNoOverlap &&
+				!isPlacementClear(&index, &pCandidate->rect, iBatchFirstId))
+			{
+				pCandidate->bClear = false;
+			}
+
+			if (pCandidate->bClear)
+			{
+				if (index.iNumRects == index.iMaxRects)
+				{
+					// the check threads are waiting, so the list can move
+					OBSTACLE_RECT* pRects = new OBSTACLE_RECT[index.iMaxRects * 2];
+					memcpy(pRects, index.pRects, index.iNumRects * sizeof(OBSTACLE_RECT));
+					delete[] index.pRects;
+					index.pRects = pRects;
+					index.iMaxRects *= 2;
+				}
+
+				OBSTACLE_RECT* pRect = &index.pRects[index.iNumRects];
+				*pRect = pCandidate->rect;
+				int iCell = (pRect->iRow / index.iCellSize) * index.iGridCols + pRect->iCol / index.iCellSize;
+				pRect->iNext = index.piCellHead[iCell];
+				index.piCellHead[iCell] = index.iNumRects;
+				index.iNumRects++;
+
+				paintObstacle(args, pRect->iRow, pRect->iCol, pRect->iEndRow, pRect->iEndCol);
+				pCandidate->bActive = false;
+			}
+			else if (pCandidate->iAttempts > args->iRetries)
+			{
+				iFailed++;
+				pCandidate->bActive = false;
+			}
+		}
+	}
+
+	fprintf(stdout, "Placed %d obstacles, %d could not be placed after %d retries, %lld positions tried\n",
+		index.iNumRects, iFailed, args->iRetries, llAttempts);
+
+	// stop the workers
+	for (int w = 0; w < iNumWorkers; w++)
+	{
+		checkargs[w + 1].bQuit = true;
+		SetEvent(checkargs[w + 1].hStartEvent);
+	}
+	if (iNumWorkers > 0)
+	{
+		WaitForMultipleObjects(iNumWorkers, phThreads, TRUE, INFINITE);
+	}
+	for (int w = 0; w < iNumWorkers; w++)
+	{
+		CloseHandle(phThreads[w]);
+		CloseHandle(checkargs[w + 1].hStartEvent);
+		CloseHandle(checkargs[w + 1].hDoneEvent);
+	}
+
+	delete[] phThreads;
+	delete[] phDoneEvents;
+	delete[] checkargs;
+	delete[] pCandidates;
+	delete[] index.pRects;
+	delete[] index.piCellHead;
+
+	return 0;
+}
+
+/*-----------------------------------------------
+	Check the batch candidates in one band of the
+	grid against the obstacles already placed
+-------------------------------------------------*/
+DWORD WINAPI checkPlacements(LPVOID lpParam)
+{
+	PLACEMENT_CHECK_ARGS* args = (PLACEMENT_CHECK_ARGS*)lpParam;
+
+	for (int i = 0; i < args->iNumCandidates; i++)
+	{
+		PLACEMENT_CANDIDATE* pCandidate = &args->pCandidates[i];
+		int iGridRow = pCandidate->rect.iRow / args->pIndex->iCellSize;
+		if (!pCandidate->bActive || !pCandidate->bClear ||
+			iGridRow < args->iFirstGridRow || iGridRow >= args->iEndGridRow)
 		{
-			nTotalRead += nCharsRead;
-			nCharsWritten = fwrite(ucaBuffer, sizeof(unsigned char), nCharsRead, pFile);
-			nTotalWritten += nCharsWritten;
-			nCharsRead = fread_s(ucaBuffer, CHUNK_SIZE, sizeof(unsigned char), CHUNK_SIZE, pInput);
+			continue;
 		}
-		fclose(pInput);
-		//fprintf(stdout, "%s - %ld chars read, %ld chars written\n", szFilename, (long) nTotalRead, (long) nTotalWritten);
-		fprintf(stdout, "Deleting temporary file %s\n", szFilename);
-		remove(szFilename);
+		pCandidate->bClear = isPlacementClear(args->pIndex, &pCandidate->rect, 0);
 	}
 
-	return bRc;
+	return 0;
 }
 
+/*-----------------------------------------------
+	A placement check thread that stays running
+	for all of the batches.  It checks its band
+	each time its start event is set, and then
+	sets its done event.
+-------------------------------------------------*/
+DWORD WINAPI checkPlacementsWorker(LPVOID lpParam)
+{
+	PLACEMENT_CHECK_ARGS* args = (PLACEMENT_CHECK_ARGS*)lpParam;
+
+	while (true)
+	{
+		WaitForSingleObject(args->hStartEvent, INFINITE);
+		if (args->bQuit)
+		{
+			break;
+		}
+		checkPlacements(args);
+		SetEvent(args->hDoneEvent);
+	}
+
+	return 0;
+}
 
 /*-----------------------------------------------
-	Add an obstacle/wall to the map.  
-	Returns true if the obstacle was added.
+	Pick a random size and position for an
+	obstacle.  Returns false if it can't fit
+	inside the border.
 -------------------------------------------------*/
-DWORD WINAPI addObstacle(LPVOID lpParam)
+bool generateCandidate(OBSTACLE_THREAD_ARGS* args, OBSTACLE_RECT* pRect)
 {
-	OBSTACLE_THREAD_ARGS* args = (OBSTACLE_THREAD_ARGS*) lpParam;
-	bool bContinue = true;
+	// pick a random width and height > 0 for the new obstacle
+	int iWidth;
+	int iHeight;
+	while (true)
+	{
+		iWidth = rand() % args->iObstacleMaxSize;
+		if (iWidth > 0)
+		{
+			break;
+		}
+	}
+	while (true)
+	{
+		iHeight = rand() % args->iObstacleMaxSize;
+		if (iHeight > 0)
+		{
+			break;
+		}
+	}
 
-	if (!args->ppcMap || args->iDimensionRows <= 0 || args->iDimensionCols <= 0)
+	// pick a random row and column so the whole obstacle is inside the border
+	int iFirstRow = MAX(1, args->iBorder);
+	int iFirstCol = MAX(1, args->iBorder);
+	int iLastRow = args->iDimensionRows - args->iBorder - iHeight;
+	int iLastCol = args->iDimensionCols - args->iBorder - iWidth;
+	if (iLastRow < iFirstRow || iLastCol < iFirstCol)
 	{
 		return false;
 	}
 
-	fprintf(stdout, "Thread id %d Generating obstacles of max size %d x %d\n",
-		GetCurrentThreadId(), args->iObstacleMaxSize, args->iObstacleMaxSize);
+	pRect->iRow = iFirstRow + randomBelow(iLastRow - iFirstRow + 1);
+	pRect->iCol = iFirstCol + randomBelow(iLastCol - iFirstCol + 1);
+	pRect->iEndRow = pRect->iRow + iHeight;
+	pRect->iEndCol = pRect->iCol + iWidth;
+	pRect->iNext = -1;
+	return true;
+}
 
-	while (bContinue)
+/*-----------------------------------------------
+	Returns true if the obstacle doesn't overlap,
+	or come within the gap of, any indexed obstacle
+	numbered iFirstId or higher.
+-------------------------------------------------*/
+bool isPlacementClear(const OBSTACLE_INDEX* pIndex, const OBSTACLE_RECT* pRect, int iFirstId)
+{
+	int iGap = pIndex->iObstacleGap;
+
+	// the cells that can hold the top left corner of an obstacle in the way
+	int iFirstGridRow = MAX(0, (pRect->iRow - iGap - pIndex->iObstacleMaxSize) / pIndex->iCellSize);
+	int iFirstGridCol = MAX(0, (pRect->iCol - iGap - pIndex->iObstacleMaxSize) / pIndex->iCellSize);
+	int iLastGridRow = MIN(pIndex->iGridRows - 1, (pRect->iEndRow + iGap - 1) / pIndex->iCellSize);
+	int iLastGridCol = MIN(pIndex->iGridCols - 1, (pRect->iEndCol + iGap - 1) / pIndex->iCellSize);
+
+	for (int r = iFirstGridRow; r <= iLastGridRow; r++)
 	{
-		DWORD dwWaitResult = WaitForSingleObject(ghObstacleMutex, INFINITE);
-		if (dwWaitResult == WAIT_OBJECT_0)
+		for (int c = iFirstGridCol; c <= iLastGridCol; c++)
 		{
-			if (giNumObstaclesRemaining > 0)
+			// newest first, so stop at the first one before iFirstId
+			for (int id = pIndex->piCellHead[r * pIndex->iGridCols + c]; id >= iFirstId; id = pIndex->pRects[id].iNext)
 			{
-				giNumObstaclesRemaining--;
-				//fprintf(stdout, "%d obstacles remaining\n", giNumObstaclesRemaining);
+				const OBSTACLE_RECT* pOther = &pIndex->pRects[id];
+				if (pRect->iRow - iGap < pOther->iEndRow && pOther->iRow < pRect->iEndRow + iGap &&
+					pRect->iCol - iGap < pOther->iEndCol && pOther->iCol < pRect->iEndCol + iGap)
+				{
+					return false;
+				}
 			}
-			else
+		}
+	}
+	return true;
+}
+
+/*-----------------------------------------------
+	Random number in [0, iRange), using two calls
+	to rand() when RAND_MAX is too small
+-------------------------------------------------*/
+int randomBelow(int iRange)
+{
+	if (iRange - 1 <= RAND_MAX)
+	{
+		return rand() % iRange;
+	}
+	long long llValue = (long long)rand() * ((long long)RAND_MAX + 1) + rand();
+	return (int)(llValue % iRange);
+}
+
+/*-----------------------------------------------
+	Write a scenario file of start/goal pairs on
+	the scaled map with their shortest path
+	lengths, sorted into buckets by length.
+	Starts and goals are drawn from rand(), so the
+	file is the same whatever the thread count.
+-------------------------------------------------*/
+bool generateScenarios(char** ppcMap, int iDimension, int iScaleFactor, int iNumPairs)
+{
+	int iFinalDimension = iDimension * iScaleFactor;
+	int iWords = (iFinalDimension + 63) / 64;
+
+	fprintf(stdout, "Generating %d scenarios\n", iNumPairs);
+
+	// pack the scaled map, one bit per cell
+	unsigned long long* pullOpen = new (std::nothrow) unsigned long long[(size_t)iFinalDimension * iWords];
+	if (pullOpen == NULL)
+	{
+		fprintf(stdout, "Not enough memory to generate the scenarios\n");
+		return false;
+	}
+	memset(pullOpen, 0, (size_t)iFinalDimension * iWords * sizeof(unsigned long long));
+	for (int r = 0; r < iFinalDimension; r++)
+	{
+		const char* pcRow = *ppcMap + (r / iScaleFactor) * iDimension;
+		unsigned long long* pullRow = pullOpen + (size_t)r * iWords;
+		for (int c = 0; c < iFinalDimension; c++)
+		{
+			if (pcRow[c / iScaleFactor] == cOPEN_CHAR)
 			{
-				bContinue = false;
+				pullRow[c >> 6] |= 1ULL << (c & 63);
 			}
 		}
-		else
+	}
+
+	// each search thread needs a few copies of the packed map, so there are
+	// no more threads than starts in the first round, which is the largest,
+	// and fewer if the memory runs out.  the buffers are reused every round
+	int iMaxThreads = MIN(giNumThreads, (iNumPairs + SCEN_GOALS_PER_START - 1) / SCEN_GOALS_PER_START);
+	SCENARIO_SEARCH_ARGS* searchargs = new SCENARIO_SEARCH_ARGS[iMaxThreads];
+	int iSearchThreads = 0;
+	while (iSearchThreads < iMaxThreads)
+	{
+		SCENARIO_SEARCH_ARGS* args = &searchargs[iSearchThreads];
+		args->pullOpen = pullOpen;
+		args->iDimension = iFinalDimension;
+		args->iWords = iWords;
+		if (!allocateSearchBuffers(args))
 		{
-			bContinue = false;
+			break;
 		}
-		ReleaseMutex(ghObstacleMutex);
+		iSearchThreads++;
+	}
+	if (iSearchThreads == 0)
+	{
+		fprintf(stdout, "Not enough memory to generate the scenarios\n");
+		delete[] searchargs;
+		delete[] pullOpen;
+		return false;
+	}
+	if (iSearchThreads < iMaxThreads)
+	{
+		fprintf(stdout, "Warning: only enough memory for %d scenario search threads\n", iSearchThreads);
+	}
 
-		if (!bContinue)
+	// starts whose goals are mostly walled off give fewer pairs, so more
+	// starts are drawn in later rounds until there are enough
+	SCENARIO_PAIR* pPairs = new SCENARIO_PAIR[iNumPairs];
+	int iFound = 0;
+	for (int iRound = 0; iRound < SCEN_MAX_ROUNDS && iFound < iNumPairs; iRound++)
+	{
+		int iNumStarts = (iNumPairs - iFound + SCEN_GOALS_PER_START - 1) / SCEN_GOALS_PER_START;
+		SCENARIO_START* pStarts = new SCENARIO_START[iNumStarts];
+		for (int i = 0; i < iNumStarts; i++)
 		{
-			return 1;
+			bool bFound = randomOpenCell(pullOpen, iFinalDimension, iWords, &pStarts[i].iRow, &pStarts[i].iCol);
+			for (int g = 0; g < SCEN_GOAL_CANDIDATES && bFound; g++)
+			{
+				bFound = randomOpenCell(pullOpen, iFinalDimension, iWords, &pStarts[i].iaGoalRows[g], &pStarts[i].iaGoalCols[g]);
+			}
+			if (!bFound)
+			{
+				fprintf(stdout, "Unable to find open cells for the scenarios\n");
+				for (int t = 0; t < iSearchThreads; t++)
+				{
+					freeSearchBuffers(&searchargs[t]);
+				}
+				delete[] searchargs;
+				delete[] pStarts;
+				delete[] pPairs;
+				delete[] pullOpen;
+				return false;
+			}
 		}
 
-		//fprintf(stdout, "Thread id %d is working\n", GetCurrentThreadId());
+		// search from each start, the threads taking the starts in turn
+		int iNumThreads = MIN(iSearchThreads, iNumStarts);
+		for (int t = 0; t < iNumThreads; t++)
+		{
+			searchargs[t].pStarts = pStarts;
+			searchargs[t].iNumStarts = iNumStarts;
+		}
+		giNextScenarioStart = 0;
 
-		// pick a random width and height > 0 for the new obstacle
-		int iWidth;
-		int iHeight;
-		while (true)
+		HANDLE* phThreads = new HANDLE[iNumThreads];
+		DWORD dwThreadId;
+		for (int t = 0; t < iNumThreads; t++)
 		{
-			iWidth = rand() % args->iObstacleMaxSize;
-			if (iWidth > 0)
+			phThreads[t] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)searchScenarios, &searchargs[t], 0, &dwThreadId);
+			if (phThreads[t] == NULL)
 			{
-				break;
+				printf("CreateThread error: %d\n", GetLastError());
+				return false;
 			}
 		}
-		while (true)
+		WaitForMultipleObjects(iNumThreads, phThreads, TRUE, INFINITE);
+		for (int t = 0; t < iNumThreads; t++)
 		{
-			iHeight = rand() % args->iObstacleMaxSize;
-			if (iHeight > 0)
+			CloseHandle(phThreads[t]);
+		}
+		delete[] phThreads;
+
+		// take the first reachable goals of each start
+		for (int i = 0; i < iNumStarts && iFound < iNumPairs; i++)
+		{
+			int iGoals = 0;
+			for (int g = 0; g < SCEN_GOAL_CANDIDATES && iGoals < SCEN_GOALS_PER_START && iFound < iNumPairs; g++)
 			{
-				break;
+				if (pStarts[i].iaDistances[g] <= 0)
+				{
+					continue;
+				}
+				pPairs[iFound].iBucket = pStarts[i].iaDistances[g] / SCEN_BUCKET_WIDTH;
+				pPairs[iFound].iOrder = iFound;
+				pPairs[iFound].iStartRow = pStarts[i].iRow;
+				pPairs[iFound].iStartCol = pStarts[i].iCol;
+				pPairs[iFound].iGoalRow = pStarts[i].iaGoalRows[g];
+				pPairs[iFound].iGoalCol = pStarts[i].iaGoalCols[g];
+				pPairs[iFound].iDistance = pStarts[i].iaDistances[g];
+				iFound++;
+				iGoals++;
 			}
 		}
+		delete[] pStarts;
+	}
+	for (int t = 0; t < iSearchThreads; t++)
+	{
+		freeSearchBuffers(&searchargs[t]);
+	}
+	delete[] searchargs;
+	qsort(pPairs, iFound, sizeof(SCENARIO_PAIR), compareScenarioPairs);
 
-		// pick a random row and column > 0 and < max for the new obstacle
-		int iRow;
-		int iCol;
-		while (true)
+	bool bRc = false;
+	FILE* pFile;
+	if (fopen_s(&pFile, SCENARIO_FILENAME, "w") != 0)
+	{
+		fprintf(stdout, "Unable to open the scenario file for writing: %s\n", SCENARIO_FILENAME);
+	}
+	else
+	{
+		// x is the column and y is the row
+		fprintf(pFile, "version 1\n");
+		for (int i = 0; i < iFound; i++)
 		{
-			iRow = rand() % (args->iDimensionRows - 1);
-			if (iRow > 0)
+			fprintf(pFile, "%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.8f\n",
+				pPairs[i].iBucket, SCENARIO_MAP_NAME, iFinalDimension, iFinalDimension,
+				pPairs[i].iStartCol, pPairs[i].iStartRow, pPairs[i].iGoalCol, pPairs[i].iGoalRow,
+				(double)pPairs[i].iDistance);
+		}
+		bRc = !ferror(pFile);
+		fclose(pFile);
+
+		// the pairs are sorted by bucket, so each new bucket starts a run
+		int iNumBuckets = 0;
+		int iMinDistance = 0;
+		int iMaxDistance = 0;
+		for (int i = 0; i < iFound; i++)
+		{
+			if (i == 0 || pPairs[i].iBucket != pPairs[i - 1].iBucket)
 			{
-				break;
+				iNumBuckets++;
+			}
+			if (i == 0 || pPairs[i].iDistance < iMinDistance)
+			{
+				iMinDistance = pPairs[i].iDistance;
 			}
+			iMaxDistance = MAX(iMaxDistance, pPairs[i].iDistance);
 		}
-		while (true)
+		fprintf(stdout, "Scenarios written: %s, %d pairs in %d buckets, path lengths %d to %d\n",
+			SCENARIO_FILENAME, iFound, iNumBuckets, iMinDistance, iMaxDistance);
+		if (iFound < iNumPairs)
 		{
-			iCol = rand() % (args->iDimensionCols - 1);
-			if (iCol > 0)
+			fprintf(stdout, "Only %d of the %d pairs could be reached from their starts\n", iFound, iNumPairs);
+		}
+	}
+
+	delete[] pPairs;
+	delete[] pullOpen;
+	return bRc;
+}
+
+/*-----------------------------------------------
+	Breadth first search from scenario starts
+	until all of their goals are reached.
+
+	The search works on 64 bit words of packed
+	rows: a frontier word's cells reach left and
+	right by shifting it, and up and down by the
+	same word in the rows above and below, masked
+	by the open cells not yet visited.  The words
+	holding frontier cells are kept in a list, so
+	a level only costs the words on its frontier
+	rather than whole rows.
+-------------------------------------------------*/
+DWORD WINAPI searchScenarios(LPVOID lpParam)
+{
+	SCENARIO_SEARCH_ARGS* args = (SCENARIO_SEARCH_ARGS*)lpParam;
+	int iDimension = args->iDimension;
+	int iWords = args->iWords;
+	int iNumWords = iDimension * iWords;
+
+	// the frontier and next buffers start clear and are left clear
+	unsigned long long* pullVisited = args->pullVisited;
+	unsigned long long* pullFrontier = args->pullFrontier;
+	unsigned long long* pullNext = args->pullNext;
+	int* piFrontierWords = args->piFrontierWords;
+	int* piNextWords = args->piNextWords;
+
+	while (true)
+	{
+		int iStart = args->iNumStarts;
+		DWORD dwWaitResult = WaitForSingleObject(ghScenarioMutex, INFINITE);
+		if (dwWaitResult == WAIT_OBJECT_0)
+		{
+			iStart = giNextScenarioStart++;
+		}
+		ReleaseMutex(ghScenarioMutex);
+
+		if (iStart >= args->iNumStarts)
+		{
+			break;
+		}
+
+		SCENARIO_START* pStart = &args->pStarts[iStart];
+		int iUnreached = 0;
+		for (int g = 0; g < SCEN_GOAL_CANDIDATES; g++)
+		{
+			pStart->iaDistances[g] = -1;
+			if (pStart->iaGoalRows[g] == pStart->iRow && pStart->iaGoalCols[g] == pStart->iCol)
 			{
-				break;
+				pStart->iaDistances[g] = 0;
+			}
+			else
+			{
+				iUnreached++;
 			}
 		}
 
-		//fprintf(stdout, "Thread id %d Obstacle at row %d, col %d of width %d, height %d\n", 
-		//	GetCurrentThreadId(), iRow, iCol, iWidth, iHeight);
-
-		int iEndRow = MIN((iRow + iHeight), args->iDimensionRows);
-		int iEndCol = MIN((iCol + iWidth), args->iDimensionCols);
+		memset(pullVisited, 0, iNumWords * sizeof(unsigned long long));
+		int iStartWord = pStart->iRow * iWords + (pStart->iCol >> 6);
+		pullFrontier[iStartWord] = 1ULL << (pStart->iCol & 63);
+		pullVisited[iStartWord] = pullFrontier[iStartWord];
+		piFrontierWords[0] = iStartWord;
+		int iNumFrontierWords = 1;
 
-		dwWaitResult = WaitForSingleObject(ghMapMutex, INFINITE);
-		if (dwWaitResult == WAIT_OBJECT_0)
+		for (int iDistance = 1; iUnreached > 0 && iNumFrontierWords > 0; iDistance++)
 		{
-			for (int i = iRow; i < iEndRow; i++)
+			int iNumNextWords = 0;
+			for (int i = 0; i < iNumFrontierWords; i++)
+			{
+				int iWord = piFrontierWords[i];
+				int iRow = iWord / iWords;
+				int iCol = iWord - iRow * iWords;
+				unsigned long long ullCells = pullFrontier[iWord];
+				pullFrontier[iWord] = 0;
+
+				// the words the cells can move into and the bits they reach there
+				int iaTargets[5];
+				unsigned long long ullaReach[5];
+				int iNumTargets = 0;
+				iaTargets[iNumTargets] = iWord;
+				ullaReach[iNumTargets++] = (ullCells << 1) | (ullCells >> 1);
+				if (iCol > 0 && (ullCells & 1))
+				{
+					iaTargets[iNumTargets] = iWord - 1;
+					ullaReach[iNumTargets++] = 1ULL << 63;
+				}
+				if (iCol + 1 < iWords && (ullCells >> 63))
+				{
+					iaTargets[iNumTargets] = iWord + 1;
+					ullaReach[iNumTargets++] = 1;
+				}
+				if (iRow > 0)
+				{
+					iaTargets[iNumTargets] = iWord - iWords;
+					ullaReach[iNumTargets++] = ullCells;
+				}
+				if (iRow + 1 < iDimension)
+				{
+					iaTargets[iNumTargets] = iWord + iWords;
+					ullaReach[iNumTargets++] = ullCells;
+				}
+
+				for (int t = 0; t < iNumTargets; t++)
+				{
+					int iTarget = iaTargets[t];
+					unsigned long long ullNew = ullaReach[t] & args->pullOpen[iTarget] & ~pullVisited[iTarget];
+					if (ullNew)
+					{
+						if (pullNext[iTarget] == 0)
+						{
+							piNextWords[iNumNextWords++] = iTarget;
+						}
+						pullNext[iTarget] |= ullNew;
+						pullVisited[iTarget] |= ullNew;
+					}
+				}
+			}
+
+			for (int g = 0; g < SCEN_GOAL_CANDIDATES; g++)
 			{
-				for (int j = iCol; j < iEndCol; j++)
+				if (pStart->iaDistances[g] < 0 &&
+					isOpenCell(pullVisited, iWords, pStart->iaGoalRows[g], pStart->iaGoalCols[g]))
 				{
-					*(*args->ppcMap + i * args->iDimensionCols + j) = cOBSTACLE_CHAR;
+					pStart->iaDistances[g] = iDistance;
+					iUnreached--;
 				}
 			}
+
+			// the next level becomes the frontier.  the old frontier words
+			// were cleared as they were expanded
+			unsigned long long* pullSwap = pullFrontier;
+			pullFrontier = pullNext;
+			pullNext = pullSwap;
+			int* piSwap = piFrontierWords;
+			piFrontierWords = piNextWords;
+			piNextWords = piSwap;
+			iNumFrontierWords = iNumNextWords;
+		}
+
+		// leave the frontier clear for the next start
+		for (int i = 0; i < iNumFrontierWords; i++)
+		{
+			pullFrontier[piFrontierWords[i]] = 0;
 		}
-		ReleaseMutex(ghMapMutex);
 	}
 
 	return 0;
 }
 
+/*-----------------------------------------------
+	Allocate the buffers for one scenario search
+	thread.  Returns false, with nothing left
+	allocated, if there isn't enough memory.
+-------------------------------------------------*/
+bool allocateSearchBuffers(SCENARIO_SEARCH_ARGS* args)
+{
+	int iNumWords = args->iDimension * args->iWords;
+	args->pullVisited = new (std::nothrow) unsigned long long[iNumWords];
+	args->pullFrontier = new (std::nothrow) unsigned long long[iNumWords];
+	args->pullNext = new (std::nothrow) unsigned long long[iNumWords];
+
+	// the words that are non-zero in the frontier and next buffers.  a
+	// word is only added to a list when it goes from zero to non-zero, so
+	// neither list can hold more than every word
+	args->piFrontierWords = new (std::nothrow) int[iNumWords];
+	args->piNextWords = new (std::nothrow) int[iNumWords];
+
+	if (args->pullVisited == NULL || args->pullFrontier == NULL || args->pullNext == NULL ||
+		args->piFrontierWords == NULL || args->piNextWords == NULL)
+	{
+		freeSearchBuffers(args);
+		return false;
+	}
+	memset(args->pullFrontier, 0, iNumWords * sizeof(unsigned long long));
+	memset(args->pullNext, 0, iNumWords * sizeof(unsigned long long));
+	return true;
+}
+
+/*-----------------------------------------------
+	Free the buffers of a scenario search thread
+-------------------------------------------------*/
+void freeSearchBuffers(SCENARIO_SEARCH_ARGS* args)
+{
+	delete[] args->pullVisited;
+	delete[] args->pullFrontier;
+	delete[] args->pullNext;
+	delete[] args->piFrontierWords;
+	delete[] args->piNextWords;
+	args->pullVisited = NULL;
+	args->pullFrontier = NULL;
+	args->pullNext = NULL;
+	args->piFrontierWords = NULL;
+	args->piNextWords = NULL;
+}
+
+/*-----------------------------------------------
+	Returns true if the cell's bit is set
+-------------------------------------------------*/
+bool isOpenCell(const unsigned long long* pullOpen, int iWords, int iRow, int iCol)
+{
+	return (pullOpen[(size_t)iRow * iWords + (iCol >> 6)] >> (iCol & 63)) & 1;
+}
+
+/*-----------------------------------------------
+	Pick a random open cell.  Returns false if
+	none is found after many tries.
+-------------------------------------------------*/
+bool randomOpenCell(const unsigned long long* pullOpen, int iDimension, int iWords, int* piRow, int* piCol)
+{
+	for (int i = 0; i < 100000; i++)
+	{
+		*piRow = randomBelow(iDimension);
+		*piCol = randomBelow(iDimension);
+		if (isOpenCell(pullOpen, iWords, *piRow, *piCol))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/*-----------------------------------------------
+	qsort order for scenario pairs: by bucket,
+	then in the order they were found
+-------------------------------------------------*/
+int compareScenarioPairs(const void* pFirst, const void* pSecond)
+{
+	const SCENARIO_PAIR* pA = (const SCENARIO_PAIR*)pFirst;
+	const SCENARIO_PAIR* pB = (const SCENARIO_PAIR*)pSecond;
+	if (pA->iBucket != pB->iBucket)
+	{
+		return pA->iBucket < pB->iBucket ? -1 : 1;
+	}
+	return pA->iOrder - pB->iOrder;
+}
+
 
 
 /*-----------------------------------------------